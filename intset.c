@@ -1,355 +1,458 @@
 /*
- * Difference tries are a variant of tries which attempt to mitigate
- * the shortcomings of tries at the cost of some of their nice
- * properties (mostly, ordering).
- *
- * The basic technique is to extend branch nodes with a mask
- * indicating which bits of a number are to be discriminated upon at
- * that branch: the term "difference tries" arises because each bit in
- * a mask indicates the position of a *difference* between the
- * children of the branch.
- *
- * Leaves are maintained as sorted vectors of numbers. Once reaching a
- * certain length, leaves are split into a branch and a number
- * of leaves.
- * 
+ * The default variant of the set, and the code shared by every
+ * variant.
  */
 
-/*
- * todo: testing, benchmarking
- * todo: implement coalescing, union, intersection, difference
- */
-
-#include <stdio.h>
-#include <stdlib.h>
-#include <stdint.h>
-
+#define INTSET_IMPLEMENT
 #include "intset.h"
 
-typedef enum { INTSET_BRANCH = 1, INTSET_LEAF } intset_tag;
+THREAD_LOCAL intset_reader *intset_current_reader;
 
-enum {
-    LEAF_SIZE_THRESHOLD = 64,
-    BRANCH_BITS = 5,
-    BRANCH_LEN = 32,
-    TAG_BITS_MASK = 3
-};
-
-typedef struct intset_leaf {
-    unsigned len;
-    unsigned values[1]; /* struct hack */
-} intset_leaf;
+intset_arena *intset_arena_new(void) {
+    intset_arena *arena = calloc(1, sizeof(intset_arena));
+    if (arena == NULL)
+        oom_die();
+    return arena;
+}
 
-typedef struct intset_branch {
-    unsigned mask;
-    tagged_ptr ptrs[BRANCH_LEN];
-} intset_branch;
+intset_arena *intset_arena_new_shared(void) {
+    intset_arena *arena = intset_arena_new();
 
-static int is_null(tagged_ptr ptr) {
-    return ptr.value == 0;
+    arena->shared = 1;
+    arena->epoch = 1;
+    return arena;
 }
 
-static tagged_ptr null_tagged_ptr() {
-    tagged_ptr ptr;
-    ptr.value = 0;
-    return ptr;
-}
+intset_arena *intset_arena_new_concurrent(void) {
+    intset_arena *arena = intset_arena_new_shared();
 
-static intset_tag tag_of(tagged_ptr ptr) {
-    return ptr.value & TAG_BITS_MASK;
+    arena->concurrent = 1;
+    arena->locks = calloc(LOCK_STRIPES, sizeof(lock_stripe));
+    if (arena->locks == NULL)
+        oom_die();
+    return arena;
 }
 
-static intset_leaf *unbox_as_leaf(tagged_ptr ptr) {
-    return (intset_leaf *)(ptr.value & ~TAG_BITS_MASK);
-}
+void intset_arena_free(intset_arena *arena) {
+    void *chunk = arena->chunks;
+    intset_reader *reader = arena->readers;
+    unsigned e;
 
-static intset_branch *unbox_as_branch(tagged_ptr ptr) {
-    return (intset_branch *)(ptr.value & ~TAG_BITS_MASK);
+    while (chunk != NULL) {
+        void *next = *(void **)chunk;
+        free(chunk);
+        chunk = next;
+    }
+    while (reader != NULL) {
+        intset_reader *next = reader->next;
+
+        /* what a writer retired is in its heap, and goes with it */
+        if (reader->heap != NULL)
+            intset_arena_free(reader->heap);
+        for (e = 0; e < EPOCHS; e++)
+            free(reader->limbo[e].nodes);
+        free(reader);
+        reader = next;
+    }
+    for (e = 0; e < EPOCHS; e++)
+        free(arena->limbo[e].nodes);
+    free(arena->locks);
+    free(arena->refs.keys);
+    free(arena->refs.counts);
+    free(arena);
 }
 
-static tagged_ptr box_as_leaf(intset_leaf *leaf) {
-    tagged_ptr ptr;
-    ptr.leaf = (intset_leaf *)((uintptr_t)leaf | INTSET_LEAF);
-    return ptr;
-}
+intset_reader *intset_reader_new(intset_arena *arena) {
+    intset_reader *reader;
+    int unused = 0;
 
-static tagged_ptr box_as_branch(intset_branch *branch) {
-    tagged_ptr ptr;
-    ptr.branch = (intset_branch *)((uintptr_t)branch | INTSET_BRANCH);
-    return ptr;
+    /* reuse a free record if there is one */
+    for (reader = LOAD_ACQUIRE(&arena->readers); reader != NULL;
+         reader = reader->next)
+        if (CAS(&reader->in_use, &unused, 1))
+            return reader;
+        else
+            unused = 0;
+    reader = calloc(1, sizeof(intset_reader));
+    if (reader == NULL)
+        oom_die();
+    reader->in_use = 1;
+    reader->arena = arena;
+    reader->next = LOAD_ACQUIRE(&arena->readers);
+    while (!CAS(&arena->readers, &reader->next, reader))
+        ;
+    return reader;
 }
 
-static unsigned leaf_size(unsigned num_elts) {
-    return sizeof(intset_leaf) + (num_elts - 1) * sizeof(unsigned);
+void intset_reader_free(intset_reader *reader) {
+    STORE_RELEASE(&reader->in_use, 0);
 }
 
-void intset_destroy1(tagged_ptr ptr) {
-    if (is_null(ptr))
-        return;
-    if (tag_of(ptr) == INTSET_LEAF)
-        free(unbox_as_leaf(ptr));
-    else {
-        intset_branch *branch = unbox_as_branch(ptr);
-        unsigned i;
-
-        for (i = 0; i < BRANCH_LEN; i++)
-            intset_destroy1(branch->ptrs[i]);
-        free(branch);
-    }
+void intset_read_begin(intset_reader *reader) {
+    /* pairs with the reads of epochs in reclaim */
+    EXCHANGE(&reader->epoch, LOAD_ACQUIRE(&reader->arena->epoch));
+    intset_current_reader = reader;
 }
 
-static unsigned is_pow2(unsigned n) {
-    return (n & (n - 1)) == 0;
+void intset_read_end(intset_reader *reader) {
+    flush_size(reader);
+    intset_current_reader = NULL;
+    STORE_RELEASE(&reader->epoch, 0);
 }
 
-static void oom_die() {
-    fprintf(stderr, "out of memory");
-    abort();
-}
+THREAD_LOCAL intset_pool *intset_current_pool;
 
-static intset_leaf *new_leaf(unsigned elt) {
-    intset_leaf *leaf = malloc(sizeof(intset_leaf));
-    if (leaf == NULL)
-        oom_die();
-    leaf->len = 1;
-    leaf->values[0] = elt;
-    return leaf;
+void intset_pool_use(intset_pool *pool) {
+    intset_current_pool = pool;
 }
 
-static unsigned lowest_bit(unsigned x) {
-    return x & -x;
-}
+#if !defined(INTSET_NO_THREADS) && defined(__GNUC__)                  \
+    && (defined(__unix__) || defined(__APPLE__))
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
 
 /*
- * Return a mask of bits that differ in at least one element of
- * @a. The number of bits will be BRANCH_BITS exactly.
- * 
- * Why doesn't this doesn't run over the end of the array? Because the
- * invariants of the data structure mean that the right number of bits
- * will always be found before then.
+ * The thread pool. Each of its threads, counting the one using it as
+ * the first, has a deque of tasks: it pushes and pops them at the
+ * bottom, while the others take them from the top when out of work
+ * of their own. A thread waiting on its tasks runs tasks meanwhile,
+ * so nested ones can't deadlock. Tasks are coarse enough that the
+ * deques are simply locked.
  */
-static unsigned differing_bits(unsigned *a) {
-    unsigned base = *a, bits = 0;
-    unsigned bits_left = BRANCH_BITS;
-
-    while (bits_left > 0) {
-        unsigned diff;
-        diff = (base ^ *a++) & ~bits;
-        if (diff) {
-            bits |= lowest_bit(diff);
-            bits_left--;
-        }
-    }
-    return bits;
-}
+enum {
+    POOL_DEQUE = 1024,
+    POOL_CUTOFF = 65536,        /* the default */
+    POOL_FANOUT = 256
+};
 
-static intset_branch *new_branch(unsigned mask) {
-    intset_branch *branch = calloc(1, sizeof(intset_branch));
-    if (branch == NULL)
-        oom_die();
-    branch->mask = mask;
-    return branch;
-}
+typedef struct {
+    pool_task *task;
+    void *ctx;
+    unsigned i;
+    intset_arena *arena;
+    unsigned *pending;          /* the tasks of its batch yet to finish */
+} pool_job;
+
+typedef struct {
+    pthread_mutex_t lock;
+    pool_job *jobs[POOL_DEQUE];
+    unsigned top, bottom;
+    intset_arena *heap;         /* if it has allocated anything yet */
+    intset_pool *pool;
+    pthread_t thread;
+} pool_worker;
+
+struct intset_pool {
+    unsigned threads, cutoff;
+    pool_worker *workers;
+    pthread_mutex_t lock;       /* for idle threads to sleep on */
+    pthread_cond_t wake;
+    unsigned queued;            /* the number of jobs in the deques */
+    int stop;
+};
+
+static THREAD_LOCAL pool_worker *current_worker;
 
 /*
- * Return the index of @x in a branch with mask @mask.
+ * Move the memory of @from, in use or not, into @to. Both must be
+ * plain arenas.
  */
-static unsigned branch_index(unsigned mask, unsigned x) {
-    unsigned index = 0, n = 0, num_bits = BRANCH_BITS;
-
-    while (num_bits--) {
-        unsigned bit = lowest_bit(mask);
-        mask ^= bit; /* works because bit is a subset of mask */
-        index |= !!(bit & x) << n;
-        n++;
+static void arena_adopt(intset_arena *to, intset_arena *from) {
+    size_t rest = (size_t)(from->end - from->next) / ARENA_GRANULE;
+    void **tail;
+    unsigned cls;
+
+    /* the rest of the newest chunk goes on the free lists too */
+    while (rest > 0) {
+        size_t n = rest < ARENA_CLASSES ? rest : ARENA_CLASSES - 1;
+
+        arena_release(from, from->next, n);
+        from->next += n * ARENA_GRANULE;
+        rest -= n;
+    }
+    from->next = from->end = NULL;
+    if (from->chunks != NULL) {
+        for (tail = from->chunks; *tail != NULL; tail = *tail)
+            ;
+        *tail = to->chunks;
+        to->chunks = from->chunks;
+        from->chunks = NULL;
+    }
+    for (cls = 0; cls < ARENA_CLASSES; cls++) {
+        if (from->free_lists[cls] == NULL)
+            continue;
+        for (tail = from->free_lists[cls]; *tail != NULL; tail = *tail)
+            ;
+        *tail = to->free_lists[cls];
+        to->free_lists[cls] = from->free_lists[cls];
+        from->free_lists[cls] = NULL;
     }
-
-    return index;
 }
 
-/*
- * Specialised insertion routine that assumes the pointer argument is
- * either null or an leaf in which all the elements are less than the
- * insertion value.
- */
-static tagged_ptr insert_ordered(tagged_ptr ptr, unsigned elt) {
-    if (is_null(ptr))
-        return box_as_leaf(new_leaf(elt));
-    else {
-        intset_leaf *leaf = unbox_as_leaf(ptr);
-
-        if (is_pow2(leaf->len)) {
-            leaf = realloc(leaf, leaf_size(leaf->len * 2));
-            if (leaf == NULL)
-                oom_die();
-        }
-        leaf->values[leaf->len++] = elt;
+static int push_job(pool_worker *worker, pool_job *job) {
+    int pushed = 0;
 
-        return box_as_leaf(leaf);
+    pthread_mutex_lock(&worker->lock);
+    if (worker->bottom < POOL_DEQUE) {
+        worker->jobs[worker->bottom++] = job;
+        pushed = 1;
     }
+    pthread_mutex_unlock(&worker->lock);
+    if (pushed)
+        __atomic_fetch_add(&worker->pool->queued, 1, __ATOMIC_RELAXED);
+    return pushed;
 }
 
-static tagged_ptr split_leaf_insert(intset_leaf *leaf, unsigned elt) {
-    unsigned i, index;
-    intset_branch *branch = new_branch(differing_bits(leaf->values));
+/* take a job from the bottom of @worker's deque, or else the top */
+static pool_job *take_job(pool_worker *worker, int bottom) {
+    pool_job *job = NULL;
 
-    for (i = 0; i < leaf->len; i++) {
-        index = branch_index(branch->mask, leaf->values[i]);
-        branch->ptrs[index] = insert_ordered(branch->ptrs[index],
-                                             leaf->values[i]);
+    pthread_mutex_lock(&worker->lock);
+    if (worker->top < worker->bottom) {
+        if (bottom)
+            job = worker->jobs[--worker->bottom];
+        else
+            job = worker->jobs[worker->top++];
+        if (worker->top == worker->bottom)
+            worker->top = worker->bottom = 0;
     }
+    pthread_mutex_unlock(&worker->lock);
+    if (job != NULL)
+        __atomic_fetch_sub(&worker->pool->queued, 1, __ATOMIC_RELAXED);
+    return job;
+}
 
-    index = branch_index(branch->mask, elt);
-    intset_insert1(branch->ptrs[index], &branch->ptrs[index], elt);
-    free(leaf);
+static pool_job *find_job(pool_worker *self) {
+    intset_pool *pool = self->pool;
+    unsigned i, me = (unsigned)(self - pool->workers);
+    pool_job *job = take_job(self, 1);
 
-    return box_as_branch(branch);
+    for (i = 1; job == NULL && i < pool->threads; i++)
+        job = take_job(&pool->workers[(me + i) % pool->threads], 0);
+    return job;
 }
 
-/* todo: might be worthwhile trying a branchless power-of-two
- * search */
-#if 0
-static unsigned
-find_in_block(const unsigned a[], unsigned len, unsigned elt) {
-    unsigned diff, i, l = 0, r = len;
-
-    while (1) {
-        unsigned mid;
-
-        diff = r - l;
-        if (diff < 32)
-            break;
-        mid = l + diff / 2;
-        if (elt < a[mid])
-            r = mid;
-        else if (elt > a[mid])
-            l = mid + 1;
-        else
-            return mid;
-    }
-    for (i = l; i < r; i++)
-        if (!(a[i] < elt))
-            break;
-    return i;
-}
-#elif 1
-static unsigned
-find_in_block(const unsigned a[], unsigned len, unsigned elt) {
-    unsigned i;
-    for (i = 0; i < len; i++)
-        if (!(a[i] < elt))
-            break;
-    return i;
-}
-#endif
+static void run_job(pool_worker *self, pool_job *job) {
+    intset_arena *heap = NULL;
 
-static tagged_ptr insert_in_leaf(intset_leaf *leaf, unsigned elt) {
-    unsigned len = leaf->len;
-    unsigned i, point = find_in_block(leaf->values, len, elt);
-
-    if (point < len && leaf->values[point] == elt)
-        return box_as_leaf(leaf);
-    if (is_pow2(len)) {
-        if (len == LEAF_SIZE_THRESHOLD)
-            return split_leaf_insert(leaf, elt);
-        leaf = realloc(leaf, leaf_size(len * 2));
-        if (leaf == NULL)
-            oom_die();
+    if (job->arena != NULL) {
+        if (self->heap == NULL)
+            self->heap = intset_arena_new();
+        heap = self->heap;
     }
-    for (i = len; i > point; i--)
-        leaf->values[i] = leaf->values[i - 1];
-    leaf->values[point] = elt;
-    leaf->len = len + 1;
-    return box_as_leaf(leaf);
+    job->task(job->ctx, job->i, heap);
+    __atomic_fetch_sub(job->pending, 1, __ATOMIC_RELEASE);
 }
 
-void intset_insert1(tagged_ptr node, tagged_ptr *ref, unsigned elt) {
-    unsigned index;
-    intset_branch *branch;
+static void *pool_main(void *arg) {
+    pool_worker *self = arg;
+    intset_pool *pool = self->pool;
+    int stop = 0;
 
-    while (1) {
-        if (is_null(node)) {
-            *ref = box_as_leaf(new_leaf(elt));
-            return;
-        }
-        if (tag_of(node) == INTSET_LEAF) {
-            *ref = insert_in_leaf(unbox_as_leaf(node), elt);
-            return;
+    current_worker = self;
+    intset_current_pool = pool;
+    while (!stop) {
+        pool_job *job = find_job(self);
+
+        if (job != NULL) {
+            run_job(self, job);
+            continue;
         }
-        branch = unbox_as_branch(node);
-        index = branch_index(branch->mask, elt);
-        ref = &branch->ptrs[index];
-        node = branch->ptrs[index];
+        pthread_mutex_lock(&pool->lock);
+        while (!pool->stop
+               && __atomic_load_n(&pool->queued, __ATOMIC_RELAXED) == 0)
+            pthread_cond_wait(&pool->wake, &pool->lock);
+        stop = pool->stop;
+        pthread_mutex_unlock(&pool->lock);
     }
+    return NULL;
 }
 
-unsigned intset_size1(tagged_ptr node) {
-    const intset_branch *branch;
-    unsigned i, count = 0;
+intset_pool *intset_pool_new(unsigned threads, unsigned cutoff) {
+    intset_pool *pool = calloc(1, sizeof(intset_pool));
+    unsigned i;
 
-    if (is_null(node))
-        return 0;
-    if (tag_of(node) == INTSET_LEAF) {
-        intset_leaf *leaf = unbox_as_leaf(node);
-        return leaf->len;
+    if (threads == 0) {
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = n > 0 ? (unsigned)n : 1;
+    }
+    if (pool == NULL
+        || (pool->workers = calloc(threads, sizeof(pool_worker))) == NULL)
+        oom_die();
+    pool->cutoff = cutoff > 0 ? cutoff : POOL_CUTOFF;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+    for (i = 0; i < threads; i++) {
+        pthread_mutex_init(&pool->workers[i].lock, NULL);
+        pool->workers[i].pool = pool;
     }
-    
-    branch = unbox_as_branch(node);
-    for (i = 0; i < BRANCH_LEN; i++)
-        count += intset_size1(branch->ptrs[i]);
-    return count;
+    pool->threads = threads;
+    for (i = 1; i < threads; i++)
+        if (pthread_create(&pool->workers[i].thread, NULL, pool_main,
+                           &pool->workers[i]) != 0)
+            oom_die();
+    return pool;
 }
 
-int intset_contains1(tagged_ptr node, unsigned elt) {
-    while (1) {
-        if (is_null(node))
-            return 0;
-        if (tag_of(node) == INTSET_LEAF) {
-            const intset_leaf *leaf = unbox_as_leaf(node);
-            unsigned i = find_in_block(leaf->values, leaf->len, elt);
-            return i < leaf->len && leaf->values[i] == elt;
-        }
-        else {
-            const intset_branch *branch = unbox_as_branch(node);
-            unsigned i = branch_index(branch->mask, elt);
-            node = branch->ptrs[i];
-        }
+void intset_pool_free(intset_pool *pool) {
+    unsigned i;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+    for (i = 1; i < pool->threads; i++)
+        pthread_join(pool->workers[i].thread, NULL);
+    for (i = 0; i < pool->threads; i++) {
+        if (pool->workers[i].heap != NULL)
+            intset_arena_free(pool->workers[i].heap);
+        pthread_mutex_destroy(&pool->workers[i].lock);
     }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->wake);
+    free(pool->workers);
+    free(pool);
 }
 
-static tagged_ptr remove_in_leaf(intset_leaf *leaf, unsigned elt) {
-    unsigned i, point = find_in_block(leaf->values, leaf->len, elt);
+void intset_pool_run(intset_pool *pool, intset_arena *arena, unsigned n,
+                     pool_task *task, void *ctx) {
+    pool_job jobs[POOL_FANOUT];
+    pool_worker *self = current_worker;
+    unsigned i, pending = n, pushed = 0;
 
-    if (point == leaf->len || leaf->values[point] != elt)
-        return box_as_leaf(leaf);
+    if (n == 0)
+        return;
+    if (self == NULL)
+        current_worker = pool->workers;
+    for (i = 0; i < n; i++) {
+        jobs[i].task = task;
+        jobs[i].ctx = ctx;
+        jobs[i].i = i;
+        jobs[i].arena = arena;
+        jobs[i].pending = &pending;
+    }
+    /* in reverse, so that they're popped back in order */
+    for (i = n; i-- > 1; )
+        if (push_job(current_worker, &jobs[i]))
+            pushed++;
+        else
+            run_job(current_worker, &jobs[i]);
+    if (pushed > 0) {
+        pthread_mutex_lock(&pool->lock);
+        pthread_cond_broadcast(&pool->wake);
+        pthread_mutex_unlock(&pool->lock);
+    }
+    run_job(current_worker, &jobs[0]);
+    while (__atomic_load_n(&pending, __ATOMIC_ACQUIRE) > 0) {
+        pool_job *job = find_job(current_worker);
 
-    if (leaf->len == 1) {
-        free(leaf);
-        return null_tagged_ptr();
+        if (job != NULL)
+            run_job(current_worker, job);
+        else
+            sched_yield();
     }
+    current_worker = self;
+}
+
+void intset_pool_settle(intset_pool *pool, intset_arena *arena) {
+    unsigned i;
 
-    for (i = point; i < leaf->len - 1; i++)
-        leaf->values[i] = leaf->values[i + 1];
-    leaf->len--;
-    return box_as_leaf(leaf);
+    for (i = 0; i < pool->threads; i++)
+        if (pool->workers[i].heap != NULL)
+            arena_adopt(arena, pool->workers[i].heap);
 }
 
+unsigned intset_pool_cutoff(const intset_pool *pool) {
+    return pool->cutoff;
+}
+#else
+intset_pool *intset_pool_new(unsigned threads, unsigned cutoff) {
+    (void)threads;
+    (void)cutoff;
+    return NULL;
+}
+
+void intset_pool_free(intset_pool *pool) {
+    (void)pool;
+}
+
+/* never called, with no pools to call them on */
+void intset_pool_run(intset_pool *pool, intset_arena *arena, unsigned n,
+                     pool_task *task, void *ctx) {
+    (void)pool;
+    (void)arena;
+    (void)n;
+    (void)task;
+    (void)ctx;
+}
+
+void intset_pool_settle(intset_pool *pool, intset_arena *arena) {
+    (void)pool;
+    (void)arena;
+}
+
+unsigned intset_pool_cutoff(const intset_pool *pool) {
+    (void)pool;
+    return UINT_MAX;
+}
+#endif
+
 /*
- * fixme: remove branches that become empty
+ * Mapping saved sets. Without mmap the file is read into memory
+ * instead, which costs the read but still needs no decoding.
  */
-void intset_remove1(tagged_ptr node, tagged_ptr *ref, unsigned elt) {
-    while (1) {
-        if (is_null(node))
-            return;
-        if (tag_of(node) == INTSET_LEAF) {
-            *ref = remove_in_leaf(unbox_as_leaf(node), elt);
-            return;
-        }
-        else {
-            intset_branch *branch = unbox_as_branch(node);
-            unsigned i = branch_index(branch->mask, elt);
-            node = branch->ptrs[i];
-            ref = &branch->ptrs[i];
-        }
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+void *intset_map_file(const char *path, size_t *len) {
+    struct stat st;
+    void *p;
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0)
+        return NULL;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+        close(fd);
+        return NULL;
+    }
+    p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+        return NULL;
+    *len = (size_t)st.st_size;
+    return p;
+}
+
+void intset_unmap_file(void *p, size_t len) {
+    munmap(p, len);
+}
+#else
+void *intset_map_file(const char *path, size_t *len) {
+    FILE *file = fopen(path, "rb");
+    char *p = NULL;
+    long size;
+
+    if (file == NULL)
+        return NULL;
+    if (fseek(file, 0, SEEK_END) == 0 && (size = ftell(file)) > 0
+        && fseek(file, 0, SEEK_SET) == 0
+        && (p = malloc((size_t)size)) != NULL
+        && fread(p, 1, (size_t)size, file) != (size_t)size) {
+        free(p);
+        p = NULL;
     }
+    fclose(file);
+    if (p != NULL)
+        *len = (size_t)size;
+    return p;
 }
+
+void intset_unmap_file(void *p, size_t len) {
+    (void)len;
+    free(p);
+}
+#endif
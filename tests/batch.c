@@ -0,0 +1,134 @@
+/*
+ * Tests of sorted batch inserts and removes against a reference, mixed
+ * with single changes, in each kind of arena. Build and run from the
+ * top of the tree with
+ *
+ * cc -std=c99 -O1 -g -fsanitize=address,undefined -o batch_test \
+ *     tests/batch.c intset.c -pthread && ./batch_test
+ */
+
+#include "../intset.h"
+#include "test.h"
+
+enum { MAX_BATCH = 1 << 14 };
+
+/* a key from @ref's range, spread out by @shift */
+static unsigned key_of(size_t i, unsigned shift) {
+    return (unsigned)i << shift;
+}
+
+static void same(const intset *set, const ref_set *ref, unsigned shift) {
+    intset_iter it;
+    unsigned elt;
+    size_t count = 0;
+
+    CHECK(intset_check(set));
+    CHECK(intset_size(set) == ref->size);
+    intset_iter_init(&it, set);
+    while (intset_iter_next(&it, &elt)) {
+        CHECK(elt >> shift < ref->range && key_of(elt >> shift, shift) == elt);
+        CHECK(ref->has[elt >> shift]);
+        count++;
+    }
+    CHECK(count == ref->size);
+}
+
+/*
+ * Fill @keys with an ascending batch, repeating some keys, that is
+ * dense or sparse, clustered or spread, as @kind picks.
+ */
+static size_t make_batch(unsigned *keys, size_t range, unsigned shift,
+                         unsigned kind) {
+    size_t n = 1 + test_below(kind % 2 ? MAX_BATCH : 64), i, at;
+    size_t step = 1 + test_below(kind % 4 < 2 ? 4 : range / n + 1);
+
+    at = test_below(range);
+    for (i = 0; i < n; i++) {
+        if (at >= range)
+            break;
+        keys[i] = key_of(at, shift);
+        /* repeat about one in eight */
+        if (test_below(8) != 0)
+            at += step;
+    }
+    return i;
+}
+
+static void test(intset_arena *arena, int snapshots, unsigned shift) {
+    size_t range = (size_t)1 << (20 - shift / 2), i, j, n, expect;
+    unsigned *keys = malloc(MAX_BATCH * sizeof(unsigned));
+    intset set, snap;
+    ref_set ref;
+    unsigned round;
+
+    CHECK(keys != NULL);
+    ref_init(&ref, range);
+    intset_init_arena(&set, arena);
+    /* a snapshot keeps the batches to one element at a time */
+    if (snapshots)
+        intset_snapshot(&snap, &set);
+    for (round = 0; round < 600; round++) {
+        n = make_batch(keys, range, shift, round);
+        expect = 0;
+        if (round % 3 != 2) {
+            for (j = 0; j < n; j++)
+                expect += ref_put(&ref, keys[j] >> shift, 1);
+            CHECK(intset_insert_sorted_batch(&set, keys, n) == expect);
+        } else {
+            for (j = 0; j < n; j++)
+                expect += ref_put(&ref, keys[j] >> shift, 0);
+            CHECK(intset_remove_sorted_batch(&set, keys, n) == expect);
+        }
+        for (j = 0; j < 50; j++) {
+            i = test_below(range);
+            if (test_below(2))
+                CHECK(intset_insert(&set, key_of(i, shift))
+                      == ref_put(&ref, i, 1));
+            else
+                CHECK(intset_remove(&set, key_of(i, shift))
+                      == ref_put(&ref, i, 0));
+        }
+        if (round % 50 == 0)
+            same(&set, &ref, shift);
+    }
+    same(&set, &ref, shift);
+
+    /* intset_from_array takes the batch path when it can */
+    n = make_batch(keys, range, shift, 1);
+    for (j = 0; j < n; j++)
+        ref_put(&ref, keys[j] >> shift, 1);
+    intset_from_array(&set, keys, n, INTSET_SORTED);
+    same(&set, &ref, shift);
+
+    /* and removing everything leaves an empty set */
+    for (i = 0; i < range; i += MAX_BATCH) {
+        for (n = 0; n < MAX_BATCH && i + n < range; n++)
+            keys[n] = key_of(i + n, shift);
+        intset_remove_sorted_batch(&set, keys, n);
+    }
+    CHECK(intset_size(&set) == 0 && intset_check(&set));
+
+    if (snapshots)
+        intset_destroy(&snap);
+    intset_destroy(&set);
+    ref_free(&ref);
+    free(keys);
+}
+
+int main(void) {
+    unsigned shift;
+    intset_arena *arena;
+
+    for (shift = 0; shift <= 12; shift += 4) {
+        test(NULL, 0, shift);
+        arena = intset_arena_new();
+        test(arena, 0, shift);
+        test(arena, 1, shift);
+        intset_arena_free(arena);
+        arena = intset_arena_new_shared();
+        test(arena, 0, shift);
+        intset_arena_free(arena);
+    }
+    puts("batch: ok");
+    return 0;
+}
@@ -0,0 +1,699 @@
+/*
+ * Benchmarks of the set against a red-black tree and a hash set, over
+ * several workloads and distributions of keys. Build and run from the
+ * top of the tree with
+ *
+ * cc -std=c99 -O2 -DNDEBUG -o bench tests/bench.c intset.c -pthread
+ * ./bench [n [distribution [set]]]
+ *
+ * which times n (by default a million) operations of each workload on
+ * each set, and optionally only the named distribution and set. Times
+ * are in ns per operation. Memory is in bytes per element, as each
+ * set counts it, leaving out what malloc adds. On Linux, where the
+ * hardware has counters, it also gives cache misses per lookup.
+ *
+ * Every set is called through the same table of functions, so each
+ * pays for an indirect call, and the sets must agree on the result
+ * of every operation.
+ */
+
+#define _GNU_SOURCE
+#include <string.h>
+#include <time.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "../intset.h"
+#include "test.h"
+
+/* the geometry for large tables, generated here */
+#define INTSET_NAME intset_wide
+#define INTSET_BRANCH_BITS 8
+#define INTSET_LEAF_MAX 512
+#define INTSET_IMPLEMENT
+#include "../intset_template.h"
+
+typedef struct {
+    const char *name;
+    void *(*create)(void);
+    int (*insert)(void *set, unsigned key);
+    int (*contains)(void *set, unsigned key);
+    int (*remove)(void *set, unsigned key);
+    size_t (*memory)(void *set);
+    void (*destroy)(void *set);
+} set_ops;
+
+/* the set, with its own nodes or in an arena */
+
+static void *intset_create(void) {
+    intset *set = malloc(sizeof(intset));
+
+    CHECK(set != NULL);
+    intset_init(set);
+    return set;
+}
+
+static void *intset_create_arena(void) {
+    intset *set = malloc(sizeof(intset));
+
+    CHECK(set != NULL);
+    intset_init_arena(set, intset_arena_new());
+    return set;
+}
+
+static int intset_insert_op(void *set, unsigned key) {
+    return intset_insert(set, key);
+}
+
+static int intset_contains_op(void *set, unsigned key) {
+    return intset_contains(set, key);
+}
+
+static int intset_remove_op(void *set, unsigned key) {
+    return intset_remove(set, key);
+}
+
+static size_t intset_memory_op(void *set) {
+    return intset_memory(set);
+}
+
+static void intset_destroy_op(void *p) {
+    intset *set = p;
+    intset_arena *arena = set->arena;
+
+    intset_destroy(set);
+    if (arena != NULL)
+        intset_arena_free(arena);
+    free(set);
+}
+
+static void *wide_create(void) {
+    intset_wide *set = malloc(sizeof(intset_wide));
+
+    CHECK(set != NULL);
+    intset_wide_init_arena(set, intset_arena_new());
+    return set;
+}
+
+static int wide_insert(void *set, unsigned key) {
+    return intset_wide_insert(set, key);
+}
+
+static int wide_contains(void *set, unsigned key) {
+    return intset_wide_contains(set, key);
+}
+
+static int wide_remove(void *set, unsigned key) {
+    return intset_wide_remove(set, key);
+}
+
+static size_t wide_memory(void *set) {
+    return intset_wide_memory(set);
+}
+
+static void wide_destroy(void *p) {
+    intset_wide *set = p;
+    intset_arena *arena = set->arena;
+
+    intset_wide_destroy(set);
+    intset_arena_free(arena);
+    free(set);
+}
+
+/*
+ * A left-leaning red-black tree (Sedgewick), with a node per key as a
+ * typical balanced tree has.
+ */
+typedef struct rb_node {
+    unsigned key;
+    int red;
+    struct rb_node *left, *right;
+} rb_node;
+
+typedef struct {
+    rb_node *root;
+    size_t size;
+} rb_tree;
+
+static int is_red(const rb_node *h) {
+    return h != NULL && h->red;
+}
+
+static rb_node *rotate_left(rb_node *h) {
+    rb_node *x = h->right;
+
+    h->right = x->left;
+    x->left = h;
+    x->red = h->red;
+    h->red = 1;
+    return x;
+}
+
+static rb_node *rotate_right(rb_node *h) {
+    rb_node *x = h->left;
+
+    h->left = x->right;
+    x->right = h;
+    x->red = h->red;
+    h->red = 1;
+    return x;
+}
+
+static void flip_colors(rb_node *h) {
+    h->red = !h->red;
+    h->left->red = !h->left->red;
+    h->right->red = !h->right->red;
+}
+
+static rb_node *balance(rb_node *h) {
+    if (is_red(h->right) && !is_red(h->left))
+        h = rotate_left(h);
+    if (is_red(h->left) && is_red(h->left->left))
+        h = rotate_right(h);
+    if (is_red(h->left) && is_red(h->right))
+        flip_colors(h);
+    return h;
+}
+
+static rb_node *rb_insert1(rb_node *h, unsigned key, int *added) {
+    if (h == NULL) {
+        h = malloc(sizeof(rb_node));
+        CHECK(h != NULL);
+        h->key = key;
+        h->red = 1;
+        h->left = h->right = NULL;
+        *added = 1;
+        return h;
+    }
+    if (key < h->key)
+        h->left = rb_insert1(h->left, key, added);
+    else if (key > h->key)
+        h->right = rb_insert1(h->right, key, added);
+    return balance(h);
+}
+
+static rb_node *move_red_left(rb_node *h) {
+    flip_colors(h);
+    if (is_red(h->right->left)) {
+        h->right = rotate_right(h->right);
+        h = rotate_left(h);
+        flip_colors(h);
+    }
+    return h;
+}
+
+static rb_node *move_red_right(rb_node *h) {
+    flip_colors(h);
+    if (is_red(h->left->left)) {
+        h = rotate_right(h);
+        flip_colors(h);
+    }
+    return h;
+}
+
+/* remove the least key under @h, storing it in @key */
+static rb_node *rb_remove_min(rb_node *h, unsigned *key) {
+    if (h->left == NULL) {
+        *key = h->key;
+        free(h);
+        return NULL;
+    }
+    if (!is_red(h->left) && !is_red(h->left->left))
+        h = move_red_left(h);
+    h->left = rb_remove_min(h->left, key);
+    return balance(h);
+}
+
+/* remove @key, which must be under @h */
+static rb_node *rb_remove1(rb_node *h, unsigned key) {
+    if (key < h->key) {
+        if (!is_red(h->left) && !is_red(h->left->left))
+            h = move_red_left(h);
+        h->left = rb_remove1(h->left, key);
+    } else {
+        if (is_red(h->left))
+            h = rotate_right(h);
+        if (key == h->key && h->right == NULL) {
+            free(h);
+            return NULL;
+        }
+        if (!is_red(h->right) && !is_red(h->right->left))
+            h = move_red_right(h);
+        if (key == h->key)
+            h->right = rb_remove_min(h->right, &h->key);
+        else
+            h->right = rb_remove1(h->right, key);
+    }
+    return balance(h);
+}
+
+static void *rb_create(void) {
+    rb_tree *tree = calloc(1, sizeof(rb_tree));
+
+    CHECK(tree != NULL);
+    return tree;
+}
+
+static int rb_contains(void *p, unsigned key) {
+    const rb_node *h = ((rb_tree *)p)->root;
+
+    while (h != NULL && h->key != key)
+        h = key < h->key ? h->left : h->right;
+    return h != NULL;
+}
+
+static int rb_insert(void *p, unsigned key) {
+    rb_tree *tree = p;
+    int added = 0;
+
+    tree->root = rb_insert1(tree->root, key, &added);
+    tree->root->red = 0;
+    tree->size += added;
+    return added;
+}
+
+static int rb_remove(void *p, unsigned key) {
+    rb_tree *tree = p;
+
+    if (!rb_contains(tree, key))
+        return 0;
+    if (!is_red(tree->root->left) && !is_red(tree->root->right))
+        tree->root->red = 1;
+    tree->root = rb_remove1(tree->root, key);
+    if (tree->root != NULL)
+        tree->root->red = 0;
+    tree->size--;
+    return 1;
+}
+
+static size_t rb_memory(void *p) {
+    return sizeof(rb_tree) + ((rb_tree *)p)->size * sizeof(rb_node);
+}
+
+static void rb_destroy1(rb_node *h) {
+    if (h != NULL) {
+        rb_destroy1(h->left);
+        rb_destroy1(h->right);
+        free(h);
+    }
+}
+
+static void rb_destroy(void *p) {
+    rb_destroy1(((rb_tree *)p)->root);
+    free(p);
+}
+
+/*
+ * An open-addressing hash set with linear probing, at most half full,
+ * removing by shifting later keys back rather than with tombstones.
+ * Zero marks an empty slot, so is kept aside.
+ */
+typedef struct {
+    unsigned *slots;
+    unsigned bits;
+    size_t len;
+    int has_zero;
+} hash_set;
+
+static size_t home(const hash_set *set, unsigned key) {
+    return (size_t)(((uint64_t)key * 0x9e3779b97f4a7c15ull)
+                    >> (64 - set->bits));
+}
+
+static void *hash_create(void) {
+    hash_set *set = calloc(1, sizeof(hash_set));
+
+    CHECK(set != NULL);
+    set->bits = 4;
+    set->slots = calloc((size_t)1 << set->bits, sizeof(unsigned));
+    CHECK(set->slots != NULL);
+    return set;
+}
+
+static int hash_contains(void *p, unsigned key) {
+    const hash_set *set = p;
+    size_t mask = ((size_t)1 << set->bits) - 1, i;
+
+    if (key == 0)
+        return set->has_zero;
+    for (i = home(set, key); set->slots[i] != 0; i = (i + 1) & mask)
+        if (set->slots[i] == key)
+            return 1;
+    return 0;
+}
+
+static void hash_put(hash_set *set, unsigned key) {
+    size_t mask = ((size_t)1 << set->bits) - 1, i = home(set, key);
+
+    while (set->slots[i] != 0)
+        i = (i + 1) & mask;
+    set->slots[i] = key;
+}
+
+static void hash_grow(hash_set *set) {
+    unsigned *old = set->slots;
+    size_t i, cap = (size_t)1 << set->bits;
+
+    set->bits++;
+    set->slots = calloc(2 * cap, sizeof(unsigned));
+    CHECK(set->slots != NULL);
+    for (i = 0; i < cap; i++)
+        if (old[i] != 0)
+            hash_put(set, old[i]);
+    free(old);
+}
+
+static int hash_insert(void *p, unsigned key) {
+    hash_set *set = p;
+
+    if (hash_contains(set, key))
+        return 0;
+    if (key == 0)
+        set->has_zero = 1;
+    else {
+        if (2 * (set->len + 1) > (size_t)1 << set->bits)
+            hash_grow(set);
+        hash_put(set, key);
+        set->len++;
+    }
+    return 1;
+}
+
+static int hash_remove(void *p, unsigned key) {
+    hash_set *set = p;
+    size_t mask = ((size_t)1 << set->bits) - 1, i, j;
+
+    if (key == 0) {
+        int had = set->has_zero;
+
+        set->has_zero = 0;
+        return had;
+    }
+    for (i = home(set, key); set->slots[i] != key; i = (i + 1) & mask)
+        if (set->slots[i] == 0)
+            return 0;
+    /* close the gap with any later key that may not probe past it */
+    for (j = (i + 1) & mask; set->slots[j] != 0; j = (j + 1) & mask)
+        if (((j - home(set, set->slots[j])) & mask) >= ((j - i) & mask)) {
+            set->slots[i] = set->slots[j];
+            i = j;
+        }
+    set->slots[i] = 0;
+    set->len--;
+    return 1;
+}
+
+static size_t hash_memory(void *p) {
+    const hash_set *set = p;
+
+    return sizeof(hash_set) + ((size_t)1 << set->bits) * sizeof(unsigned);
+}
+
+static void hash_destroy(void *p) {
+    free(((hash_set *)p)->slots);
+    free(p);
+}
+
+static const set_ops sets[] = {
+    { "intset", intset_create, intset_insert_op, intset_contains_op,
+      intset_remove_op, intset_memory_op, intset_destroy_op },
+    { "intset-arena", intset_create_arena, intset_insert_op,
+      intset_contains_op, intset_remove_op, intset_memory_op,
+      intset_destroy_op },
+    { "intset-wide", wide_create, wide_insert, wide_contains, wide_remove,
+      wide_memory, wide_destroy },
+    { "rbtree", rb_create, rb_insert, rb_contains, rb_remove, rb_memory,
+      rb_destroy },
+    { "hash", hash_create, hash_insert, hash_contains, hash_remove,
+      hash_memory, hash_destroy },
+};
+
+enum { SETS = sizeof(sets) / sizeof(sets[0]) };
+
+/*
+ * Distributions of keys. Each fills @a with @n keys in the order they
+ * are to be inserted; the first half is inserted and the rest are
+ * mostly misses.
+ */
+static void shuffle(unsigned *a, size_t n) {
+    size_t i, j;
+    unsigned t;
+
+    for (i = n; i > 1; i--) {
+        j = test_below(i);
+        t = a[i - 1];
+        a[i - 1] = a[j];
+        a[j] = t;
+    }
+}
+
+static void uniform(unsigned *a, size_t n) {
+    size_t i;
+
+    for (i = 0; i < n; i++)
+        a[i] = (unsigned)test_rand();
+}
+
+/* about half of the range below n */
+static void dense(unsigned *a, size_t n) {
+    size_t i;
+
+    for (i = 0; i < n; i++)
+        a[i] = (unsigned)test_below(n);
+}
+
+/* ascending, as for ids handed out in turn */
+static void sequential(unsigned *a, size_t n) {
+    size_t i;
+
+    for (i = 0; i < n; i++)
+        a[i] = (unsigned)i;
+}
+
+/* runs of 32 consecutive keys at random places, in random order */
+static void clustered(unsigned *a, size_t n) {
+    size_t i;
+    unsigned base = 0;
+
+    for (i = 0; i < n; i++) {
+        if (i % 32 == 0)
+            base = (unsigned)test_rand() & ~31u;
+        a[i] = base + (unsigned)(i % 32);
+    }
+    shuffle(a, n);
+}
+
+/* multiples of a large power of two, which share their low bits */
+static void strided(unsigned *a, size_t n) {
+    size_t i;
+
+    for (i = 0; i < n; i++)
+        a[i] = (unsigned)(test_below(n) << 12);
+}
+
+static const struct {
+    const char *name;
+    void (*fill)(unsigned *a, size_t n);
+} distributions[] = {
+    { "uniform", uniform },
+    { "dense", dense },
+    { "sequential", sequential },
+    { "clustered", clustered },
+    { "strided", strided },
+};
+
+enum { DISTRIBUTIONS = sizeof(distributions) / sizeof(distributions[0]) };
+
+static double now(void) {
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+/* counting cache misses, where the hardware and system allow */
+#ifdef __linux__
+static int miss_counter(void) {
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static void start_counting(int fd) {
+    if (fd >= 0) {
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+}
+
+static double stop_counting(int fd) {
+    uint64_t count;
+
+    if (fd < 0)
+        return -1;
+    ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+    if (read(fd, &count, sizeof(count)) != sizeof(count))
+        return -1;
+    return (double)count;
+}
+#else
+static int miss_counter(void) {
+    return -1;
+}
+
+static void start_counting(int fd) {
+    (void)fd;
+}
+
+static double stop_counting(int fd) {
+    (void)fd;
+    return -1;
+}
+#endif
+
+/* the operations, made up before anything is timed */
+typedef struct {
+    size_t n;
+    unsigned *keys;             /* 2n, the first n of them inserted */
+    unsigned *lookups;          /* n, about half of them hits */
+    unsigned *mixed;            /* n keys for the mixed workload */
+    unsigned char *kinds;       /* whether each is a lookup (0 or 1),
+                                   an insert (2) or a remove (3) */
+    unsigned *removals;         /* n, the inserted keys in a new order */
+} workload;
+
+/* the answers from the first set, which the others must match */
+typedef struct {
+    size_t inserted, hits, mixed, removed;
+} results;
+
+static void run(const set_ops *ops, const workload *w, int counter,
+                results *expected, int first) {
+    void *set = ops->create();
+    results got = { 0, 0, 0, 0 };
+    double t0, insert, lookup, mixed, remove, misses;
+    size_t i, memory;
+
+    t0 = now();
+    for (i = 0; i < w->n; i++)
+        got.inserted += ops->insert(set, w->keys[i]);
+    insert = now() - t0;
+    memory = ops->memory(set);
+
+    start_counting(counter);
+    t0 = now();
+    for (i = 0; i < w->n; i++)
+        got.hits += ops->contains(set, w->lookups[i]);
+    lookup = now() - t0;
+    misses = stop_counting(counter);
+
+    t0 = now();
+    for (i = 0; i < w->n; i++) {
+        unsigned key = w->mixed[i];
+
+        switch (w->kinds[i]) {
+        case 2:
+            got.mixed += ops->insert(set, key);
+            break;
+        case 3:
+            got.mixed += ops->remove(set, key);
+            break;
+        default:
+            got.mixed += ops->contains(set, key);
+        }
+    }
+    mixed = now() - t0;
+
+    t0 = now();
+    for (i = 0; i < w->n; i++)
+        got.removed += ops->remove(set, w->removals[i]);
+    remove = now() - t0;
+    ops->destroy(set);
+
+    if (first)
+        *expected = got;
+    CHECK(got.inserted == expected->inserted && got.hits == expected->hits
+          && got.mixed == expected->mixed
+          && got.removed == expected->removed);
+    printf("  %-14s %8.1f %8.1f %8.1f %8.1f %10.1f", ops->name,
+           insert / w->n, lookup / w->n, remove / w->n, mixed / w->n,
+           (double)memory / (got.inserted ? got.inserted : 1));
+    if (misses >= 0)
+        printf(" %8.2f", misses / w->n);
+    putchar('\n');
+}
+
+static void make_workload(workload *w, size_t n,
+                          void (*fill)(unsigned *, size_t)) {
+    size_t i;
+
+    w->n = n;
+    w->keys = malloc(2 * n * sizeof(unsigned));
+    w->lookups = malloc(n * sizeof(unsigned));
+    w->mixed = malloc(n * sizeof(unsigned));
+    w->kinds = malloc(n);
+    w->removals = malloc(n * sizeof(unsigned));
+    CHECK(w->keys != NULL && w->lookups != NULL && w->mixed != NULL
+          && w->kinds != NULL && w->removals != NULL);
+    fill(w->keys, 2 * n);
+    for (i = 0; i < n; i++) {
+        w->lookups[i] = w->keys[test_below(2 * n)];
+        w->mixed[i] = w->keys[test_below(2 * n)];
+        w->kinds[i] = (unsigned char)test_below(4);
+        w->removals[i] = w->keys[i];
+    }
+    shuffle(w->removals, n);
+}
+
+static void free_workload(workload *w) {
+    free(w->keys);
+    free(w->lookups);
+    free(w->mixed);
+    free(w->kinds);
+    free(w->removals);
+}
+
+int main(int argc, char **argv) {
+    size_t n = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+    int counter = miss_counter();
+    unsigned d, s;
+
+    if (n == 0) {
+        fprintf(stderr, "usage: %s [n [distribution [set]]]\n", argv[0]);
+        return 1;
+    }
+    printf("%zu operations of each kind; ns per operation\n", n);
+    for (d = 0; d < DISTRIBUTIONS; d++) {
+        workload w;
+        results expected = { 0, 0, 0, 0 };
+        int first = 1;
+
+        if (argc > 2 && strcmp(argv[2], distributions[d].name) != 0)
+            continue;
+        test_seed(d + 1);
+        make_workload(&w, n, distributions[d].fill);
+        printf("%s\n  %-14s %8s %8s %8s %8s %10s%s\n", distributions[d].name,
+               "set", "insert", "contains", "remove", "mixed", "bytes/elt",
+               counter >= 0 ? " misses/lookup" : "");
+        for (s = 0; s < SETS; s++) {
+            if (argc > 3 && strcmp(argv[3], sets[s].name) != 0)
+                continue;
+            run(&sets[s], &w, counter, &expected, first);
+            first = 0;
+        }
+        free_workload(&w);
+    }
+    return 0;
+}
@@ -0,0 +1,201 @@
+/*
+ * A stress test of concurrent arenas: several writers change a set at
+ * once, each owning keys interleaved with the others' so that they
+ * share leaves and branches, while readers look up elements that
+ * always stay. Each writer keeps a reference for its own keys, so the
+ * set must come out exactly as they say. Last, a writer works on
+ * whole sets while it has changes not yet counted. Build and run from
+ * the top of the tree with
+ *
+ * cc -std=c99 -O1 -g -fsanitize=thread -o concurrent_test \
+ *     tests/concurrent.c intset.c -pthread && ./concurrent_test
+ *
+ * or with -fsanitize=address,undefined in place of thread.
+ */
+
+#include <pthread.h>
+
+#include "../intset.h"
+#include "test.h"
+
+enum {
+    WRITERS = 4,
+    READERS = 2,
+    FIXED = 1 << 18,            /* multiples of 4 below this always stay */
+    WRITES = 200000             /* by each writer */
+};
+
+static intset_arena *arena;
+static intset set;
+static int stop;
+
+/* the key of writer @id with number @i */
+static unsigned key_of(unsigned id, size_t i) {
+    return (unsigned)((i / 3 * WRITERS + id) * 4 + 1 + i % 3);
+}
+
+typedef struct {
+    pthread_t thread;
+    unsigned id;
+    ref_set ref;                /* numbered as for key_of */
+} writer;
+
+static void *write_keys(void *arg) {
+    writer *w = arg;
+    intset_reader *r = intset_reader_new(arena);
+    size_t range = w->ref.range, i, j;
+    uint64_t state = w->id * 0x9e3779b97f4a7c15ull + 1;
+
+    for (j = 0; j < WRITES; j++) {
+        state = state * 6364136223846793005ull + 1442695040888963407ull;
+        i = (size_t)(state >> 33) % range;
+        intset_read_begin(r);
+        if (state >> 32 & 1)
+            CHECK(intset_insert(&set, key_of(w->id, i))
+                  == ref_put(&w->ref, i, 1));
+        else
+            CHECK(intset_remove(&set, key_of(w->id, i))
+                  == ref_put(&w->ref, i, 0));
+        intset_read_end(r);
+    }
+    /* then empty a stretch of its keys, so branches coalesce */
+    for (i = 0; i < range / 2; i++) {
+        intset_read_begin(r);
+        CHECK(intset_remove(&set, key_of(w->id, i)) == ref_put(&w->ref, i, 0));
+        intset_read_end(r);
+    }
+    intset_reader_free(r);
+    return NULL;
+}
+
+static void *read_keys(void *arg) {
+    intset_reader *r = intset_reader_new(arena);
+    uint64_t state = (uint64_t)(uintptr_t)arg;
+    unsigned k, x;
+
+    while (!__atomic_load_n(&stop, __ATOMIC_RELAXED)) {
+        intset_read_begin(r);
+        for (k = 0; k < 1000; k++) {
+            state = state * 6364136223846793005ull + 1442695040888963407ull;
+            x = (unsigned)(state >> 33) % FIXED & ~3u;
+            CHECK(intset_contains(&set, x));
+            CHECK(!intset_contains(&set, x + 4 * FIXED));
+        }
+        intset_read_end(r);
+    }
+    intset_reader_free(r);
+    return NULL;
+}
+
+/* add @n keys to @to, from @base on in steps of 16 */
+static void add(intset *to, unsigned n, unsigned base) {
+    unsigned i;
+
+    for (i = 0; i < n; i++)
+        CHECK(intset_insert(to, i * 16 + base));
+}
+
+/*
+ * Whole-set operations by a writer inside its own read section, with
+ * changes to the set it has not yet counted, as it has fewer than 64
+ * of them (or 64 and some more): they must see the set as it is. Its
+ * own size is only exact once it leaves the section.
+ */
+static void test_uncounted(void) {
+    intset_arena *own = intset_arena_new_concurrent();
+    intset_reader *r = intset_reader_new(own);
+    unsigned keys[5] = { 1, 2, 3, 16, 32 }, n;
+    intset a, b, dst;
+
+    for (n = 10; n <= 100; n += 90) {
+        intset_init_arena(&a, own);
+        intset_init_arena(&b, own);
+        intset_read_begin(r);
+        add(&a, n, 8);
+        intset_from_array(&a, keys, 3, 0);
+        CHECK(intset_check(&a) && intset_contains(&a, 1));
+        CHECK(intset_contains(&a, (n - 1) * 16 + 8));
+        intset_from_array(&b, keys, 5, INTSET_SORTED);
+
+        add(&a, n, 9);
+        intset_init_arena(&dst, own);
+        intset_union(&dst, &a, &b);
+        CHECK(intset_check(&dst) && intset_size(&dst) == 2 * n + 5);
+        intset_destroy(&dst);
+
+        add(&a, n, 10);
+        intset_init(&dst);
+        intset_difference(&dst, &a, &b);
+        CHECK(intset_check(&dst) && intset_size(&dst) == 3 * n);
+        intset_destroy(&dst);
+        intset_read_end(r);
+
+        CHECK(intset_size(&a) == 3 * n + 3 && intset_size(&b) == 5);
+        intset_read_begin(r);
+        CHECK(intset_check(&a));
+        intset_destroy(&a);
+        intset_destroy(&b);
+        intset_read_end(r);
+    }
+    intset_reader_free(r);
+    intset_arena_free(own);
+}
+
+int main(void) {
+    writer writers[WRITERS];
+    pthread_t readers[READERS];
+    intset_reader *r;
+    intset copy;
+    size_t i, size = FIXED / 4;
+    unsigned id;
+
+    arena = intset_arena_new_concurrent();
+    r = intset_reader_new(arena);
+    intset_init_arena(&set, arena);
+    intset_read_begin(r);
+    for (i = 0; i < FIXED; i += 4)
+        intset_insert(&set, (unsigned)i);
+    intset_read_end(r);
+
+    for (i = 0; i < READERS; i++)
+        CHECK(pthread_create(&readers[i], NULL, read_keys,
+                             (void *)(uintptr_t)(i + 1)) == 0);
+    for (id = 0; id < WRITERS; id++) {
+        writers[id].id = id;
+        /* keeping all the keys below 4 * FIXED */
+        ref_init(&writers[id].ref, 3 * FIXED / WRITERS);
+        CHECK(pthread_create(&writers[id].thread, NULL, write_keys,
+                             &writers[id]) == 0);
+    }
+    for (id = 0; id < WRITERS; id++)
+        pthread_join(writers[id].thread, NULL);
+    __atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+    for (i = 0; i < READERS; i++)
+        pthread_join(readers[i], NULL);
+
+    /* everything else needs the set to itself */
+    intset_read_begin(r);
+    CHECK(intset_check(&set));
+    for (id = 0; id < WRITERS; id++) {
+        for (i = 0; i < writers[id].ref.range; i++)
+            CHECK(intset_contains(&set, key_of(id, i))
+                  == writers[id].ref.has[i]);
+        size += writers[id].ref.size;
+    }
+    CHECK(intset_size(&set) == size);
+    for (i = 0; i < FIXED; i += 4)
+        CHECK(intset_contains(&set, (unsigned)i));
+    intset_init(&copy);
+    intset_union(&copy, &set, &set);
+    CHECK(intset_size(&copy) == size && intset_equal(&copy, &set));
+    intset_destroy(&copy);
+    intset_destroy(&set);
+    intset_read_end(r);
+    intset_reader_free(r);
+    intset_arena_free(arena);
+    for (id = 0; id < WRITERS; id++)
+        ref_free(&writers[id].ref);
+    test_uncounted();
+    puts("concurrent: ok");
+    return 0;
+}
@@ -0,0 +1,296 @@
+/*
+ * A fuzz target: each input is a program of inserts, removes, lookups,
+ * batches, set algebra and snapshots, run on a set of 32-bit keys and
+ * on one of 64-bit keys against a reference bitmap, with every
+ * invariant checked after each step. With libFuzzer, from the top of
+ * the tree:
+ *
+ * clang -std=c99 -g -O1 -fsanitize=fuzzer,address,undefined \
+ *     -DINTSET_LIBFUZZER -o fuzz tests/fuzz.c intset.c intset64.c \
+ *     -pthread && ./fuzz
+ *
+ * Built without INTSET_LIBFUZZER it has a main of its own, which runs
+ * the files named on its command line as inputs (as AFL wants, with
+ * @@), or else as many random inputs as its first argument says, 200
+ * by default. That is a quick check, of well under a minute with the
+ * sanitizers, which slow each input down a good deal:
+ *
+ * cc -std=c99 -g -O1 -fsanitize=address,undefined -o fuzz \
+ *     tests/fuzz.c intset.c intset64.c -pthread && ./fuzz
+ */
+
+#include <string.h>
+
+#include "../intset.h"
+#include "../intset64.h"
+#include "test.h"
+
+enum {
+    RANGE = 1 << 16,            /* of the reference, indexed by number */
+    MAX_RUN = 256               /* the most keys one batch step makes */
+};
+
+/*
+ * The sets under test. Numbers k below RANGE are keys k << shift | low
+ * in the 32-bit set, spread over both halves of a 64-bit key in the
+ * other, so that the fuzzer picks the shape of the trees.
+ */
+typedef struct {
+    intset set, other;
+    intset64 set64;
+    ref_set ref, other_ref;
+    intset_arena *arena;
+    unsigned shift, low;
+} fuzz_state;
+
+/* the input, consumed from the front; zeros once it runs out */
+typedef struct {
+    const uint8_t *data;
+    size_t len;
+} input;
+
+static unsigned next_byte(input *in) {
+    if (in->len == 0)
+        return 0;
+    in->len--;
+    return *in->data++;
+}
+
+static unsigned next_number(input *in) {
+    unsigned hi = next_byte(in);
+
+    return hi << 8 | next_byte(in);
+}
+
+static unsigned key32(const fuzz_state *s, unsigned k) {
+    return k << s->shift | s->low;
+}
+
+static uint64_t key64(const fuzz_state *s, unsigned k) {
+    return (uint64_t)key32(s, k) * 0x100000001ull;
+}
+
+/* check everything cheap after a step */
+static void check_step(const fuzz_state *s) {
+    CHECK(intset_check(&s->set) && intset_check(&s->other));
+    CHECK(intset64_check(&s->set64));
+    CHECK(intset_size(&s->set) == s->ref.size);
+    CHECK(intset64_size(&s->set64) == s->ref.size);
+    CHECK(intset_size(&s->other) == s->other_ref.size);
+}
+
+/* check that @set holds exactly the keys of @ref */
+static void check_all(const fuzz_state *s, const intset *set,
+                      const ref_set *ref) {
+    intset_iter it;
+    unsigned elt, k;
+    size_t count = 0;
+
+    intset_iter_init(&it, set);
+    while (intset_iter_next(&it, &elt)) {
+        k = elt >> s->shift;
+        CHECK(k < RANGE && key32(s, k) == elt && ref->has[k]);
+        count++;
+    }
+    CHECK(count == ref->size);
+}
+
+static void check_all64(const fuzz_state *s) {
+    intset64_iter it;
+    uint64_t elt;
+    size_t count = 0;
+    unsigned k;
+
+    intset64_iter_init(&it, &s->set64);
+    while (intset64_iter_next(&it, &elt)) {
+        k = (unsigned)elt >> s->shift;
+        CHECK(k < RANGE && key64(s, k) == elt && s->ref.has[k]);
+        count++;
+    }
+    CHECK(count == s->ref.size);
+}
+
+/* an ascending run of up to MAX_RUN numbers, with repeats, into @run */
+static size_t make_run(input *in, unsigned *run) {
+    unsigned k = next_number(in), len = next_byte(in) + 1;
+    unsigned step = next_byte(in) % 16;
+    size_t n = 0;
+
+    while (n < len && n < MAX_RUN && k < RANGE) {
+        run[n++] = k;
+        k += step;
+    }
+    return n;
+}
+
+static void step(fuzz_state *s, input *in) {
+    unsigned op = next_byte(in), run[MAX_RUN], k;
+    intset_key keys[MAX_RUN];
+    uint64_t keys64[MAX_RUN];
+    size_t i, n, expect;
+    intset snap;
+
+    switch (op % 10) {
+    case 0:
+    case 1:
+    case 2:
+        k = next_number(in);
+        expect = ref_put(&s->ref, k, 1);
+        CHECK(intset_insert(&s->set, key32(s, k)) == (int)expect);
+        CHECK(intset64_insert(&s->set64, key64(s, k)) == (int)expect);
+        break;
+    case 3:
+    case 4:
+        k = next_number(in);
+        expect = ref_put(&s->ref, k, 0);
+        CHECK(intset_remove(&s->set, key32(s, k)) == (int)expect);
+        CHECK(intset64_remove(&s->set64, key64(s, k)) == (int)expect);
+        break;
+    case 5:
+        k = next_number(in);
+        CHECK(intset_contains(&s->set, key32(s, k)) == s->ref.has[k]);
+        CHECK(intset64_contains(&s->set64, key64(s, k)) == s->ref.has[k]);
+        break;
+    case 6:
+    case 7:
+        n = make_run(in, run);
+        expect = 0;
+        for (i = 0; i < n; i++) {
+            keys[i] = key32(s, run[i]);
+            keys64[i] = key64(s, run[i]);
+            expect += ref_put(&s->ref, run[i], op % 10 == 6);
+        }
+        if (op % 10 == 6) {
+            CHECK(intset_insert_sorted_batch(&s->set, keys, n) == expect);
+            CHECK(intset64_insert_sorted_batch(&s->set64, keys64, n)
+                  == expect);
+        } else {
+            CHECK(intset_remove_sorted_batch(&s->set, keys, n) == expect);
+            CHECK(intset64_remove_sorted_batch(&s->set64, keys64, n)
+                  == expect);
+        }
+        break;
+    case 8:
+        /* add a run to the other set, then combine the two */
+        n = make_run(in, run);
+        for (i = 0; i < n; i++) {
+            keys[i] = key32(s, run[i]);
+            ref_put(&s->other_ref, run[i], 1);
+        }
+        intset_from_array(&s->other, keys, n, op & 16 ? INTSET_SORTED : 0);
+        switch (op / 32 % 3) {
+        case 0:
+            intset_union_with(&s->set, &s->other);
+            for (k = 0; k < RANGE; k++)
+                if (s->other_ref.has[k] && ref_put(&s->ref, k, 1))
+                    intset64_insert(&s->set64, key64(s, k));
+            break;
+        case 1:
+            intset_intersect_with(&s->set, &s->other);
+            for (k = 0; k < RANGE; k++)
+                if (!s->other_ref.has[k] && ref_put(&s->ref, k, 0))
+                    intset64_remove(&s->set64, key64(s, k));
+            break;
+        default:
+            intset_difference_with(&s->set, &s->other);
+            for (k = 0; k < RANGE; k++)
+                if (s->other_ref.has[k] && ref_put(&s->ref, k, 0))
+                    intset64_remove(&s->set64, key64(s, k));
+        }
+        break;
+    default:
+        /* a change to a snapshot leaves the set alone */
+        k = next_number(in);
+        intset_init_arena(&snap, s->arena);
+        intset_snapshot(&snap, &s->set);
+        if (s->ref.has[k])
+            CHECK(intset_remove(&snap, key32(s, k)));
+        else
+            CHECK(intset_insert(&snap, key32(s, k)));
+        CHECK(intset_check(&snap));
+        CHECK(intset_contains(&s->set, key32(s, k)) == s->ref.has[k]);
+        CHECK(intset_contains(&snap, key32(s, k)) != s->ref.has[k]);
+        CHECK(intset_size(&snap) + s->ref.has[k] * 2
+              == intset_size(&s->set) + 1);
+        intset_destroy(&snap);
+    }
+    check_step(s);
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    input in;
+    fuzz_state s;
+    unsigned mode;
+
+    in.data = data;
+    in.len = size;
+    mode = next_byte(&in);
+    s.shift = next_byte(&in) % 17;
+    s.low = s.shift == 0 ? 0 : next_byte(&in) & ((1u << s.shift) - 1);
+    switch (mode % 3) {
+    case 0:
+        s.arena = NULL;
+        break;
+    case 1:
+        s.arena = intset_arena_new();
+        break;
+    default:
+        s.arena = intset_arena_new_shared();
+    }
+    intset_init_arena(&s.set, s.arena);
+    intset_init_arena(&s.other, s.arena);
+    intset_set_split(&s.set, mode / 3 % 2);
+    intset64_init(&s.set64);
+    ref_init(&s.ref, RANGE);
+    ref_init(&s.other_ref, RANGE);
+
+    while (in.len > 0)
+        step(&s, &in);
+    check_all(&s, &s.set, &s.ref);
+    check_all(&s, &s.other, &s.other_ref);
+    check_all64(&s);
+
+    intset_destroy(&s.set);
+    intset_destroy(&s.other);
+    intset64_destroy(&s.set64);
+    if (s.arena != NULL)
+        intset_arena_free(s.arena);
+    ref_free(&s.ref);
+    ref_free(&s.other_ref);
+    return 0;
+}
+
+#ifndef INTSET_LIBFUZZER
+int main(int argc, char **argv) {
+    static uint8_t buf[1 << 16];
+    long runs = 200, r;
+    size_t len;
+    int i;
+
+    if (argc > 1 && strspn(argv[1], "0123456789") != strlen(argv[1])) {
+        /* files to run as inputs */
+        for (i = 1; i < argc; i++) {
+            FILE *file = fopen(argv[i], "rb");
+
+            CHECK(file != NULL);
+            len = fread(buf, 1, sizeof(buf), file);
+            fclose(file);
+            LLVMFuzzerTestOneInput(buf, len);
+        }
+        return 0;
+    }
+    if (argc > 1)
+        runs = strtol(argv[1], NULL, 10);
+    for (r = 0; r < runs; r++) {
+        test_seed((uint64_t)r);
+        len = test_below(r % 10 == 0 ? 4096 : 512);
+        for (i = 0; (size_t)i < len; i++)
+            buf[i] = (uint8_t)test_rand();
+        LLVMFuzzerTestOneInput(buf, len);
+    }
+    printf("fuzz: %ld inputs ok\n", runs);
+    return 0;
+}
+#endif
@@ -0,0 +1,141 @@
+/*
+ * Tests that set algebra and intset_from_array give the same sets on a
+ * thread pool as serially, down to the shape of the tree: both results
+ * are saved, and the files must be identical byte for byte. Build and
+ * run from the top of the tree with
+ *
+ * cc -std=c99 -O1 -g -fsanitize=thread -o parallel_test \
+ *     tests/parallel.c intset.c -pthread && ./parallel_test
+ *
+ * or with -fsanitize=address,undefined in place of thread.
+ */
+
+#include <string.h>
+
+#include "../intset.h"
+#include "test.h"
+
+enum { N = 200000 };
+
+/* the bytes of @set as saved, setting @len */
+static char *saved(const intset *set, size_t *len) {
+    FILE *file = tmpfile();
+    char *buf;
+
+    CHECK(file != NULL && intset_save(set, file) == 0);
+    *len = (size_t)ftell(file);
+    rewind(file);
+    buf = malloc(*len);
+    CHECK(buf != NULL && fread(buf, 1, *len, file) == *len);
+    fclose(file);
+    return buf;
+}
+
+static void same_tree(const intset *a, const intset *b) {
+    size_t alen, blen;
+    char *abuf = saved(a, &alen), *bbuf = saved(b, &blen);
+
+    CHECK(intset_check(a) && intset_check(b));
+    CHECK(intset_size(a) == intset_size(b));
+    CHECK(alen == blen && memcmp(abuf, bbuf, alen) == 0);
+    free(abuf);
+    free(bbuf);
+}
+
+/* keys of a kind picked by @kind, some shared between calls */
+static void fill(unsigned *keys, size_t n, unsigned kind) {
+    size_t i;
+
+    for (i = 0; i < n; i++)
+        switch (kind % 3) {
+        case 0:
+            keys[i] = (unsigned)test_rand();
+            break;
+        case 1:
+            keys[i] = (unsigned)test_below(4 * N);
+            break;
+        default:
+            keys[i] = (unsigned)test_below(N) << 10 | (unsigned)(i % 32);
+        }
+}
+
+static int ascending(const void *a, const void *b) {
+    unsigned x = *(const unsigned *)a, y = *(const unsigned *)b;
+
+    return (x > y) - (x < y);
+}
+
+/*
+ * Build the sets and results of @round with @pool in use, or serially
+ * if it is null, into @out[0..8), from the arena @arena.
+ */
+static void build(intset *out, intset_pool *pool, intset_arena *arena,
+                  const unsigned *a, const unsigned *b, const unsigned *c,
+                  unsigned round) {
+    int i;
+
+    intset_pool_use(pool);
+    for (i = 0; i < 8; i++) {
+        intset_init_arena(&out[i], arena);
+        intset_set_split(&out[i], round % 2);
+    }
+    intset_from_array(&out[0], a, N, 0);
+    intset_from_array(&out[1], b, N / 2, 0);
+    intset_from_array(&out[2], c, N, INTSET_SORTED);
+    intset_union(&out[3], &out[0], &out[1]);
+    intset_intersect(&out[4], &out[0], &out[1]);
+    intset_difference(&out[5], &out[0], &out[2]);
+    intset_copy(&out[6], &out[0]);
+    switch (round % 3) {
+    case 0:
+        intset_union_with(&out[6], &out[2]);
+        break;
+    case 1:
+        intset_intersect_with(&out[6], &out[1]);
+        break;
+    default:
+        intset_difference_with(&out[6], &out[1]);
+    }
+    /* a set that existed before the pool, added to */
+    intset_copy(&out[7], &out[1]);
+    intset_from_array(&out[7], c, N, INTSET_SORTED);
+    intset_pool_use(NULL);
+}
+
+int main(void) {
+    unsigned *a = malloc(N * sizeof(unsigned));
+    unsigned *b = malloc(N * sizeof(unsigned));
+    unsigned *c = malloc(N * sizeof(unsigned));
+    intset serial[8], parallel[8];
+    intset_pool *pool = intset_pool_new(4, 64);
+    intset_arena *arena;
+    unsigned round, i;
+
+    CHECK(a != NULL && b != NULL && c != NULL && pool != NULL);
+    for (round = 0; round < 6; round++) {
+        fill(a, N, round);
+        fill(b, N / 2, round);
+        memcpy(b + N / 4, a, N / 4 * sizeof(unsigned));
+        fill(c, N, round + 1);
+        qsort(c, N, sizeof(unsigned), ascending);
+
+        arena = round % 2 ? intset_arena_new() : NULL;
+        build(serial, NULL, arena, a, b, c, round);
+        build(parallel, pool, arena, a, b, c, round);
+        for (i = 0; i < 8; i++) {
+            same_tree(&serial[i], &parallel[i]);
+            if (arena == NULL) {
+                intset_destroy(&serial[i]);
+                intset_destroy(&parallel[i]);
+            }
+        }
+        if (arena != NULL)
+            intset_arena_free(arena);
+    }
+    intset_pool_free(pool);
+    free(a);
+    free(b);
+    free(c);
+    puts("parallel: ok");
+    return 0;
+}
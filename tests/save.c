@@ -0,0 +1,267 @@
+/*
+ * Tests of saving, loading and mapping sets, and of loading damaged
+ * files: every file intset_load accepts must give a set that passes
+ * intset_check and whose elements lookups find. Build and run from
+ * the top of the tree with
+ *
+ * cc -std=c99 -O1 -g -fsanitize=address,undefined -o save_test \
+ *     tests/save.c intset.c intset64.c -pthread && ./save_test
+ */
+
+#include <string.h>
+
+#include "../intset.h"
+#include "../intset64.h"
+#include "test.h"
+
+static const char path[] = "save_test.bin";
+
+/* write @set to a temporary file, returning it rewound */
+static FILE *saved(const intset *set) {
+    FILE *file = tmpfile();
+
+    CHECK(file != NULL);
+    CHECK(intset_save(set, file) == 0);
+    rewind(file);
+    return file;
+}
+
+/* read the whole of @file, setting @len */
+static char *contents(FILE *file, size_t *len) {
+    char *buf;
+
+    CHECK(fseek(file, 0, SEEK_END) == 0);
+    *len = (size_t)ftell(file);
+    rewind(file);
+    buf = malloc(*len);
+    CHECK(buf != NULL && fread(buf, 1, *len, file) == *len);
+    fclose(file);
+    return buf;
+}
+
+/* load the @len bytes at @buf, checking the set if they load */
+static int load_checked(const char *buf, size_t len) {
+    FILE *file = tmpfile();
+    intset set;
+    intset_iter it;
+    unsigned elt;
+    size_t count = 0;
+    int status;
+
+    CHECK(file != NULL && fwrite(buf, 1, len, file) == len);
+    rewind(file);
+    intset_init(&set);
+    status = intset_load(&set, file);
+    fclose(file);
+    if (status == 0) {
+        CHECK(intset_check(&set));
+        intset_iter_init(&it, &set);
+        while (intset_iter_next(&it, &elt)) {
+            CHECK(intset_contains(&set, elt));
+            count++;
+        }
+        CHECK(count == intset_size(&set));
+        /* and it stays usable */
+        for (count = 0; count < 100; count++) {
+            elt = (unsigned)test_rand();
+            intset_insert(&set, elt);
+            CHECK(intset_contains(&set, elt));
+        }
+        CHECK(intset_check(&set));
+    } else
+        CHECK(intset_size(&set) == 0);
+    intset_destroy(&set);
+    return status;
+}
+
+/* a set of @n elements, spread by @shift so all leaf forms turn up */
+static void fill(intset *set, unsigned n, unsigned shift) {
+    unsigned i;
+
+    for (i = 0; i < n; i++)
+        intset_insert(set, (unsigned)test_below(4 * (uint64_t)n + 1) << shift);
+    for (i = 0; i < n / 3; i++)
+        intset_remove(set, (unsigned)test_below(4 * (uint64_t)n + 1) << shift);
+}
+
+static void test_round_trip(unsigned n, unsigned shift, int arena) {
+    intset set, loaded;
+    intset_mapped map;
+    intset_arena *a = arena ? intset_arena_new() : NULL;
+    FILE *file;
+    unsigned i;
+
+    intset_init(&set);
+    intset_init_arena(&loaded, a);
+    fill(&set, n, shift);
+    file = saved(&set);
+    CHECK(intset_load(&loaded, file) == 0);
+    fclose(file);
+    CHECK(intset_check(&loaded));
+    CHECK(intset_equal(&set, &loaded));
+    CHECK(intset_size(&loaded) == intset_size(&set));
+
+    file = fopen(path, "wb");
+    CHECK(file != NULL && intset_save(&set, file) == 0);
+    fclose(file);
+    CHECK(intset_map(&map, path) == 0);
+    CHECK(intset_mapped_size(&map) == intset_size(&set));
+    for (i = 0; i < 4 * n + 8; i++)
+        CHECK(intset_mapped_contains(&map, i << shift)
+              == intset_contains(&set, i << shift));
+    intset_unmap(&map);
+    remove(path);
+
+    intset_destroy(&set);
+    intset_destroy(&loaded);
+    if (a != NULL)
+        intset_arena_free(a);
+}
+
+/* sets of one variant don't load or map as another */
+static void test_other_variant(void) {
+    intset set;
+    intset64 set64;
+    intset_mapped map;
+    FILE *file = tmpfile();
+
+    intset64_init(&set64);
+    intset64_insert(&set64, 1);
+    CHECK(file != NULL && intset64_save(&set64, file) == 0);
+    rewind(file);
+    intset_init(&set);
+    CHECK(intset_load(&set, file) == -1);
+    fclose(file);
+
+    file = fopen(path, "wb");
+    CHECK(file != NULL && intset64_save(&set64, file) == 0);
+    fclose(file);
+    CHECK(intset_map(&map, path) == -1);
+    remove(path);
+    intset64_destroy(&set64);
+}
+
+static void test_64(unsigned n) {
+    intset64 set, loaded;
+    FILE *file = tmpfile();
+    unsigned i;
+
+    intset64_init(&set);
+    intset64_init(&loaded);
+    for (i = 0; i < n; i++)
+        intset64_insert(&set, test_rand() >> (i % 64));
+    CHECK(file != NULL && intset64_save(&set, file) == 0);
+    rewind(file);
+    CHECK(intset64_load(&loaded, file) == 0);
+    fclose(file);
+    CHECK(intset64_check(&loaded));
+    CHECK(intset64_equal(&set, &loaded));
+    intset64_destroy(&set);
+    intset64_destroy(&loaded);
+}
+
+/*
+ * Flip bits of a saved set one at a time, and also cut it short and
+ * claim it is longer, loading each result.
+ */
+static void test_damage(unsigned n, unsigned shift, unsigned flips) {
+    intset set;
+    size_t len, pos, accepted = 0;
+    char *buf;
+    uint64_t bytes;
+    unsigned i;
+
+    intset_init(&set);
+    fill(&set, n, shift);
+    buf = contents(saved(&set), &len);
+    intset_destroy(&set);
+    CHECK(load_checked(buf, len) == 0);
+    for (i = 0; i < flips; i++) {
+        unsigned char bit = (unsigned char)(1 << test_below(8));
+
+        pos = test_below(len);
+        buf[pos] ^= bit;
+        accepted += load_checked(buf, len) == 0;
+        buf[pos] ^= bit;
+    }
+    for (i = 0; i < 20; i++)
+        CHECK(load_checked(buf, test_below(len)) == -1);
+    /* the length is the last field of the header */
+    memcpy(&bytes, buf + 40, sizeof(bytes));
+    CHECK(bytes == len);
+    for (i = 0; i < 64; i++) {
+        uint64_t claim = (uint64_t)1 << i;
+
+        if (claim == len)
+            continue;
+        memcpy(buf + 40, &claim, sizeof(claim));
+        CHECK(load_checked(buf, len) == -1);
+    }
+    free(buf);
+    printf("save: %u elements, %zu of %u damaged files loaded\n", n,
+           accepted, flips);
+}
+
+/* the same for 64-bit keys, whose shifts can reach further */
+static void test_damage_64(unsigned n, unsigned flips) {
+    intset64 set;
+    intset64_iter it;
+    FILE *file = tmpfile();
+    size_t len, pos, count;
+    uint64_t elt;
+    char *buf;
+    unsigned i;
+
+    intset64_init(&set);
+    for (i = 0; i < n; i++)
+        intset64_insert(&set, test_rand() >> (i % 64));
+    CHECK(file != NULL && intset64_save(&set, file) == 0);
+    intset64_destroy(&set);
+    buf = contents(file, &len);
+    for (i = 0; i < flips; i++) {
+        unsigned char bit = (unsigned char)(1 << test_below(8));
+
+        pos = test_below(len);
+        buf[pos] ^= bit;
+        file = tmpfile();
+        CHECK(file != NULL && fwrite(buf, 1, len, file) == len);
+        rewind(file);
+        intset64_init(&set);
+        if (intset64_load(&set, file) == 0) {
+            CHECK(intset64_check(&set));
+            count = 0;
+            intset64_iter_init(&it, &set);
+            while (intset64_iter_next(&it, &elt)) {
+                CHECK(intset64_contains(&set, elt));
+                count++;
+            }
+            CHECK(count == intset64_size(&set));
+        }
+        fclose(file);
+        intset64_destroy(&set);
+        buf[pos] ^= bit;
+    }
+    free(buf);
+}
+
+int main(void) {
+    unsigned n, shift;
+
+    for (n = 0; n <= 1 << 16; n = n < 4 ? n + 1 : n * 4)
+        for (shift = 0; shift < 4; shift++) {
+            test_round_trip(n, shift * 3, 0);
+            test_round_trip(n, shift * 3, 1);
+        }
+    test_other_variant();
+    test_64(0);
+    test_64(1);
+    test_64(100000);
+    test_damage(1, 0, 200);
+    test_damage(2, 0, 200);
+    test_damage(300, 0, 2000);
+    test_damage(3000, 2, 2000);
+    test_damage(20000, 7, 2000);
+    test_damage_64(5000, 2000);
+    puts("save: ok");
+    return 0;
+}
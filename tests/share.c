@@ -0,0 +1,120 @@
+/*
+ * Tests of intset_share_nodes: many sets with much in common share
+ * their nodes, then go on being changed, and each must still match
+ * its own reference, however the nodes it shared were copied. Build
+ * and run from the top of the tree with
+ *
+ * cc -std=c99 -O1 -g -fsanitize=address,undefined -o share_test \
+ *     tests/share.c intset.c -pthread && ./share_test
+ */
+
+#include "../intset.h"
+#include "test.h"
+
+enum {
+    SETS = 200,
+    RANGE = 4096,               /* keys are numbers below this, times 7 */
+    ROUNDS = 50
+};
+
+static intset sets[SETS];
+static intset *ptrs[SETS];
+static ref_set refs[SETS];
+
+static void same(unsigned i) {
+    unsigned k;
+
+    CHECK(intset_check(&sets[i]));
+    CHECK(intset_size(&sets[i]) == refs[i].size);
+    for (k = 0; k < RANGE; k++)
+        CHECK(intset_contains(&sets[i], k * 7) == refs[i].has[k]);
+}
+
+/*
+ * Make @count random changes to set @i, drawing keys from @range, from
+ * @seed if it is not zero. In even rounds the sets come in pairs (i
+ * and i + SETS / 2) that are changed alike, so that there is plenty to
+ * share.
+ */
+static void change(unsigned i, unsigned count, unsigned range,
+                   uint64_t seed) {
+    unsigned j, k;
+
+    if (seed != 0)
+        test_seed(seed);
+    for (j = 0; j < count; j++) {
+        k = (unsigned)test_below(range);
+        if (test_below(3) != 0)
+            CHECK(intset_insert(&sets[i], k * 7)
+                  == ref_put(&refs[i], k, 1));
+        else
+            CHECK(intset_remove(&sets[i], k * 7)
+                  == ref_put(&refs[i], k, 0));
+    }
+}
+
+int main(void) {
+    intset_arena *arena = intset_arena_new(), *other;
+    intset snap, alone;
+    unsigned round, i, count, range;
+
+    for (i = 0; i < SETS; i++) {
+        intset_init_arena(&sets[i], arena);
+        ptrs[i] = &sets[i];
+        ref_init(&refs[i], RANGE);
+    }
+    for (round = 0; round < ROUNDS; round++) {
+        for (i = 0; i < SETS; i++) {
+            /* small sets mostly, with a few large ones */
+            range = (i % (SETS / 2)) % 3 ? 300 : RANGE;
+            count = round ? 30 : 150;
+            if (round == 0 && (i % (SETS / 2)) % 10 == 0)
+                count += 3000;
+            if (round % 2 == 0)
+                change(i, count, range, 777 + (i % (SETS / 2)) * 31 + round);
+            else
+                change(i, count, range, 0);
+        }
+        /* empty some now and then, so freed nodes are reused */
+        if (round % 10 == 9)
+            for (i = 0; i < SETS; i += 3) {
+                intset_destroy(&sets[i]);
+                intset_init_arena(&sets[i], arena);
+                ref_free(&refs[i]);
+                ref_init(&refs[i], RANGE);
+            }
+        /* sharing twice over overlapping groups is harmless */
+        intset_share_nodes(ptrs, SETS);
+        intset_share_nodes(ptrs, SETS / 2);
+        for (i = 0; i < SETS; i++)
+            same(i);
+        /* a snapshot of a set with shared nodes, then a change to it */
+        if (round % 7 == 0) {
+            intset_snapshot(&snap, &sets[0]);
+            change(0, 20, RANGE, 0);
+            same(0);
+            intset_destroy(&snap);
+        }
+    }
+
+    /* sets of other arenas are left alone */
+    other = intset_arena_new_shared();
+    intset_init_arena(&alone, other);
+    intset_insert(&alone, 1);
+    intset_insert(&alone, 1000);
+    intset_insert(&alone, 1000000);
+    ptrs[0] = &alone;
+    intset_share_nodes(ptrs, SETS);
+    CHECK(intset_check(&alone) && intset_size(&alone) == 3);
+    intset_destroy(&alone);
+    intset_arena_free(other);
+
+    for (i = 0; i < SETS; i++) {
+        same(i);
+        intset_destroy(&sets[i]);
+        ref_free(&refs[i]);
+    }
+    intset_arena_free(arena);
+    puts("share: ok");
+    return 0;
+}
@@ -0,0 +1,259 @@
+/*
+ * Tests of shared arenas: first that their sets give the same answers
+ * as a reference through every kind of change, with one thread, then
+ * that readers never miss an element that stays or find one that was
+ * never there while a writer churns the set. Build and run from the
+ * top of the tree with
+ *
+ * cc -std=c99 -O1 -g -fsanitize=thread -o shared_test tests/shared.c \
+ *     intset.c -pthread && ./shared_test
+ *
+ * or with -fsanitize=address,undefined in place of thread.
+ */
+
+#include <pthread.h>
+#include <string.h>
+
+#include "../intset.h"
+#include "test.h"
+
+enum {
+    RANGE = 1 << 14,            /* keys are below RANGE << SHIFT */
+    SHIFT = 3,
+    READERS = 4,
+    FIXED = 200000,             /* multiples of 4 below this always stay */
+    WRITES = 300000
+};
+
+static unsigned key_of(size_t i) {
+    return (unsigned)i << SHIFT;
+}
+
+/* whether @set holds exactly the keys of @ref */
+static void same(const intset *set, const ref_set *ref) {
+    intset_iter it;
+    unsigned elt;
+    size_t count = 0;
+
+    CHECK(intset_check(set));
+    CHECK(intset_size(set) == ref->size);
+    intset_iter_init(&it, set);
+    while (intset_iter_next(&it, &elt)) {
+        CHECK(elt % (1u << SHIFT) == 0 && elt >> SHIFT < ref->range);
+        CHECK(ref->has[elt >> SHIFT]);
+        count++;
+    }
+    CHECK(count == ref->size);
+}
+
+/* a random change to @set and @ref, checked against each other */
+static void change(intset *set, ref_set *ref) {
+    size_t i = test_below(RANGE);
+
+    if (test_below(3) < 2)
+        CHECK(intset_insert(set, key_of(i)) == ref_put(ref, i, 1));
+    else
+        CHECK(intset_remove(set, key_of(i)) == ref_put(ref, i, 0));
+    i = test_below(RANGE);
+    CHECK(intset_contains(set, key_of(i)) == ref->has[i]);
+}
+
+/* the keys of a random sorted run, and the same in @ref */
+static size_t sorted_run(unsigned *keys, ref_set *ref, int has) {
+    size_t i, n = 0, step = 1 + test_below(64);
+
+    for (i = test_below(step); i < RANGE; i += step) {
+        keys[n++] = key_of(i);
+        ref_put(ref, i, has);
+    }
+    return n;
+}
+
+static void test_differential(intset_arena *arena) {
+    intset a, b, c;
+    ref_set ra, rb, rc;
+    unsigned *keys = malloc(RANGE * sizeof(unsigned));
+    size_t i, n, round;
+
+    CHECK(keys != NULL);
+    for (round = 0; round < 40; round++) {
+        intset_init_arena(&a, arena);
+        intset_init_arena(&b, arena);
+        intset_init_arena(&c, arena);
+        intset_set_split(&a, round % 2);
+        ref_init(&ra, RANGE);
+        ref_init(&rb, RANGE);
+        ref_init(&rc, RANGE);
+
+        /* bulk loading, and batches */
+        for (n = 0; n < RANGE / 4; n++) {
+            i = test_below(RANGE);
+            keys[n] = key_of(i);
+            ref_put(&rb, i, 1);
+        }
+        intset_from_array(&b, keys, n, 0);
+        same(&b, &rb);
+        n = sorted_run(keys, &rb, 1);
+        intset_insert_sorted_batch(&b, keys, n);
+        same(&b, &rb);
+        n = sorted_run(keys, &rb, 0);
+        intset_remove_sorted_batch(&b, keys, n);
+        same(&b, &rb);
+
+        for (i = 0; i < 4000; i++) {
+            change(&a, &ra);
+            change(&b, &rb);
+        }
+        same(&a, &ra);
+        same(&b, &rb);
+
+        /* set algebra, into a new set and in place */
+        switch (round % 3) {
+        case 0:
+            intset_union(&c, &a, &b);
+            for (i = 0; i < RANGE; i++)
+                ref_put(&rc, i, ra.has[i] | rb.has[i]);
+            break;
+        case 1:
+            intset_intersect(&c, &a, &b);
+            for (i = 0; i < RANGE; i++)
+                ref_put(&rc, i, ra.has[i] & rb.has[i]);
+            break;
+        default:
+            intset_difference(&c, &a, &b);
+            for (i = 0; i < RANGE; i++)
+                ref_put(&rc, i, ra.has[i] & !rb.has[i]);
+        }
+        same(&c, &rc);
+        same(&a, &ra);
+        same(&b, &rb);
+        switch (round % 3) {
+        case 0:
+            intset_union_with(&a, &b);
+            for (i = 0; i < RANGE; i++)
+                ref_put(&ra, i, ra.has[i] | rb.has[i]);
+            break;
+        case 1:
+            intset_intersect_with(&a, &b);
+            for (i = 0; i < RANGE; i++)
+                ref_put(&ra, i, ra.has[i] & rb.has[i]);
+            break;
+        default:
+            intset_difference_with(&a, &b);
+            for (i = 0; i < RANGE; i++)
+                ref_put(&ra, i, ra.has[i] & !rb.has[i]);
+        }
+        same(&a, &ra);
+        same(&b, &rb);
+
+        /* copies and snapshots are independent of the original */
+        intset_destroy(&c);
+        intset_init_arena(&c, arena);
+        intset_snapshot(&c, &b);
+        CHECK(intset_equal(&c, &b));
+        memcpy(rc.has, rb.has, RANGE);
+        rc.size = rb.size;
+        for (i = 0; i < 2000; i++) {
+            change(&b, &rb);
+            change(&c, &rc);
+        }
+        same(&b, &rb);
+        same(&c, &rc);
+
+        for (i = 0; i < RANGE; i++)
+            CHECK(intset_remove(&a, key_of(i)) == ref_put(&ra, i, 0));
+        same(&a, &ra);
+        intset_destroy(&a);
+        intset_destroy(&b);
+        intset_destroy(&c);
+        ref_free(&ra);
+        ref_free(&rb);
+        ref_free(&rc);
+    }
+    free(keys);
+}
+
+/*
+ * The stress test. The set always holds the multiples of 4 below
+ * FIXED, and never anything at or above it, while the writer toggles
+ * the keys between them.
+ */
+static intset_arena *arena;
+static intset set;
+static int stop;
+
+static void *reader(void *arg) {
+    intset_reader *r = intset_reader_new(arena);
+    unsigned keys[256], k, x;
+    uint8_t out[256];
+    uint64_t state = (uint64_t)(uintptr_t)arg * 0x9e3779b97f4a7c15ull;
+
+    for (k = 0; k < 256; k++)
+        keys[k] = k * 4 * (FIXED / 1024);
+    while (!__atomic_load_n(&stop, __ATOMIC_RELAXED)) {
+        intset_read_begin(r);
+        for (k = 0; k < 1000; k++) {
+            state = state * 6364136223846793005ull + 1442695040888963407ull;
+            x = (unsigned)(state >> 33) % FIXED;
+            CHECK((x & 3) != 0 || intset_contains(&set, x));
+            CHECK(!intset_contains(&set, x + FIXED));
+        }
+        intset_contains_batch(&set, keys, 256, out);
+        for (k = 0; k < 256; k++)
+            CHECK(out[k]);
+        intset_read_end(r);
+    }
+    intset_reader_free(r);
+    return NULL;
+}
+
+static void test_readers(void) {
+    pthread_t threads[READERS];
+    intset_iter it;
+    unsigned i, elt;
+    size_t count = 0;
+
+    arena = intset_arena_new_shared();
+    intset_init_arena(&set, arena);
+    for (i = 0; i < FIXED; i += 4)
+        intset_insert(&set, i);
+    for (i = 0; i < READERS; i++)
+        CHECK(pthread_create(&threads[i], NULL, reader,
+                             (void *)(uintptr_t)(i + 1)) == 0);
+    for (i = 0; i < WRITES; i++) {
+        unsigned x = (unsigned)test_below(FIXED);
+
+        if ((x & 3) == 0)
+            continue;
+        if (test_below(2))
+            intset_insert(&set, x);
+        else
+            intset_remove(&set, x);
+    }
+    __atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+    for (i = 0; i < READERS; i++)
+        pthread_join(threads[i], NULL);
+
+    CHECK(intset_check(&set));
+    intset_iter_init(&it, &set);
+    while (intset_iter_next(&it, &elt)) {
+        CHECK(elt < FIXED);
+        count++;
+    }
+    CHECK(count == intset_size(&set));
+    for (i = 0; i < FIXED; i += 4)
+        CHECK(intset_contains(&set, i));
+    intset_destroy(&set);
+    intset_arena_free(arena);
+}
+
+int main(void) {
+    intset_arena *a = intset_arena_new_shared();
+
+    test_differential(a);
+    intset_arena_free(a);
+    puts("shared: differential ok");
+    test_readers();
+    puts("shared: readers ok");
+    return 0;
+}
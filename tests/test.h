@@ -0,0 +1,71 @@
+/*
+ * Helpers shared by the tests. Each test is a standalone program; see
+ * the comment at the top of each for how to build and run it.
+ */
+
+#ifndef TEST_H_
+#define TEST_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/* like assert, but kept under NDEBUG */
+#define CHECK(cond)                                                     \
+    do {                                                                \
+        if (!(cond)) {                                                  \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__,      \
+                    __LINE__, #cond);                                   \
+            abort();                                                    \
+        }                                                               \
+    } while (0)
+
+/* a small generator, so that runs repeat (xorshift64*) */
+static uint64_t test_state = 88172645463325252ull;
+
+static inline void test_seed(uint64_t seed) {
+    test_state = seed * 2654435761u + 88172645463325252ull;
+}
+
+static inline uint64_t test_rand(void) {
+    test_state ^= test_state >> 12;
+    test_state ^= test_state << 25;
+    test_state ^= test_state >> 27;
+    return test_state * 2685821657736338717ull;
+}
+
+/* a number below @n */
+static inline uint64_t test_below(uint64_t n) {
+    return test_rand() % n;
+}
+
+/*
+ * A reference set of the numbers below @range, as a byte per number.
+ * Tests map these onto keys as they like.
+ */
+typedef struct {
+    unsigned char *has;
+    size_t range, size;
+} ref_set;
+
+static inline void ref_init(ref_set *ref, size_t range) {
+    ref->has = calloc(range, 1);
+    CHECK(ref->has != NULL);
+    ref->range = range;
+    ref->size = 0;
+}
+
+static inline void ref_free(ref_set *ref) {
+    free(ref->has);
+}
+
+/* set whether @ref has @i, returning whether that changed it */
+static inline int ref_put(ref_set *ref, size_t i, int has) {
+    if (ref->has[i] == has)
+        return 0;
+    ref->has[i] = (unsigned char)has;
+    ref->size += has ? 1 : (size_t)-1;
+    return 1;
+}
+
+#endif